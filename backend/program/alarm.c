@@ -3,6 +3,8 @@
 #include "util/memory.h"
 #include "util/interrupt.h"
 #include "common/defs.h"
+#include "common/timer.h"
+#include "common/power.h"
 #include "program/alarm.h"
 
 /* timer prescalers and their bits in TCCR0B */
@@ -17,7 +19,10 @@ static const struct {
 	{   1, 1}
 };
 
-static u8 bits, count, ticks;
+static void alarm_modulate(stimer_t *t);
+
+static u8 bits, count;
+static stimer_t modulator = stimer_init(alarm_modulate);
 
 void buzzer_set(u16 freq, u8 flags)
 {
@@ -29,7 +34,8 @@ void buzzer_set(u16 freq, u8 flags)
 	// turn buzzer off
 	if (flags == BUZOFF) {
 		TCCR0B &= ~7;
-		ev_set_id(ALARM_TIMER, 1);
+		stimer_cancel(&modulator);
+		power_hold(POWER_TONE, 1);
 		goto end;
 	}
 
@@ -50,6 +56,7 @@ void buzzer_set(u16 freq, u8 flags)
 	// enable timer
 	TCCR0B |= rom(ps[i].bits, byte);
 	OCR0A   = old;
+	power_hold(POWER_TONE, 0);
 
 	// enablke modulator
 	if (flags & BUZMOD) {
@@ -58,8 +65,7 @@ void buzzer_set(u16 freq, u8 flags)
 		count = OCR0A;
 
 		// start timer
-		ticks = BUZMOD_TICKS;
-		ev_set_id(ALARM_TIMER, 0);
+		stimer_arm(&modulator, BUZMOD_TICKS, BUZMOD_TICKS);
 	}
 end:
 	rest_int();
@@ -86,12 +92,8 @@ void alarm_set(u8 disable)
 	rest_int();
 }
 
-u8 e_alarm_timer(u8 unused id, u8 unused code, ptr unused arg)
+static void alarm_modulate(stimer_t unused *t)
 {
-	if (ticks-- > 0)
-		return 0;
-	ticks = BUZMOD_TICKS;
-
 	// we have a capacitor on the buzzer, so it doesn't
 	// matter if the timer leaves the pin high
 	if (TCCR0B & 7) {
@@ -100,8 +102,6 @@ u8 e_alarm_timer(u8 unused id, u8 unused code, ptr unused arg)
 		TCCR0B = bits;
 		OCR0A  = count;
 	}
-
-	return 0;
 }
 
 INIT()
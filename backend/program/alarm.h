@@ -3,7 +3,7 @@
 
 #include "util/type.h"
 
-#define BUZMOD_TICKS 1
+#define BUZMOD_TICKS 2
 #define ALARM_FREQ 500
 
 #define BUZOFF 0
@@ -2,57 +2,61 @@
 #include "util/init.h"
 #include "util/interrupt.h"
 #include "common/serial.h"
+#include "common/timer.h"
+#include "common/trace.h"
+#include "common/power.h"
+#include "util/task.h"
 #include "program/alarm.h"
 #include "program/motion.h"
 
 #include <avr/eeprom.h>
 
-#define ALARM_TIMEOUT_TICKS 100
+#define ALARM_TIMEOUT_TICKS 101
 
 // different program states
 static sstate_t sstate = INIT;
 static istate_t istate = BOOT;
 
-// event data for each type
-static stev_t stev_sstate = { .type = SHARED   };
-static stev_t stev_istate = { .type = INTERNAL };
+// state change event type for each state
+#define stev_s SHARED
+#define stev_i INTERNAL
 
 // state change dispatcher
-#define change(what, to) ({ \
-	stev_##what##state.old = what##state; \
-	stev_##what##state.now = to; \
-	dispatch(STATE, &stev_##what##state); })
+#define change(what, to) \
+	dispatch(STATE, ((stev_t){ \
+		.type = stev_##what, .old = what##state, .now = (to) }))
 
-// timer ticks
-static u8 ticks;
+static void alert_timeout(stimer_t *t);
 
-static u8 boot_counter;
+// program timers
+static stimer_t alert_timer = stimer_init(alert_timeout);
 
-static u8 boot_sequence()
+// buzzer sweep (changes to IDLE when done)
+TASK(boot_sweep)
 {
-	// boot sequence over (over 10 becomes quiet at end,
+	static u8 step;
+
+	task_begin();
+
+	// frequency sweep, one step per tick (over 10 becomes quiet at end,
 	// frequency parameter selection algorithm is probably bad)
-	if (unlikely(boot_counter >= 10)) {
-		buzzer_set(0, BUZOFF);
-		boot_counter = 0;
-		return 1;
+	for (step = 0; step < 10; step++) {
+		buzzer_set(20*step + 300, BUZON);
+		task_sleep(1);
 	}
-	ticks = 0;
 
-	// frequency sweep
-	buzzer_set(20*boot_counter + 300, BUZON);
+	buzzer_set(0, BUZOFF);
+	change(i, IDLE);
 
-	// init
-	if (unlikely(boot_counter == 0))
-		ev_set_id(PROGRAM_TIMER, 0);
-
-	boot_counter++;
-	return 0;
+	task_end();
 }
 
+static task_t boot = task_init(boot_sweep);
+
 // TODO: put in internal EEPROM
 static u16 code_mem EEMEM;
 static u16 code_ram;
+static u8 code_dirty; // code_ram not in EEPROM yet
 
 static u8 check_code(u16 code)
 {
@@ -65,9 +69,9 @@ static u8 change_code(u16 old, u16 new)
 	if (old != code_ram)
 		return 0;
 
-	// update code in RAM and EEPROM
+	// update code in RAM (EEPROM is written by e_code_persist())
 	code_ram = new;
-	eeprom_update_word(&code_mem, new);
+	code_dirty = 1;
 
 	return 1;
 }
@@ -87,8 +91,7 @@ static void sstate_change(sstate_t old, sstate_t now)
 
 	case ALRT: // motion detected
 		// begin alarm timeout
-		ticks = ALARM_TIMEOUT_TICKS;
-		ev_set_id(PROGRAM_TIMER, 0);
+		stimer_arm(&alert_timer, ALARM_TIMEOUT_TICKS, 0);
 		break;
 
 	case ALRM: // alarm on
@@ -104,7 +107,7 @@ static void sstate_change(sstate_t old, sstate_t now)
 
 		// stop timer
 		case ALRT:
-			ev_set_id(PROGRAM_TIMER, 0);
+			stimer_cancel(&alert_timer);
 			break;
 
 		// stop alarm
@@ -127,13 +130,12 @@ static void istate_change(istate_t unused old, istate_t now)
 
 	switch (now) {
 	case BOOT: // booting up
-		(void) boot_sequence();
+		task_start(&boot);
 		break;
 
 	case IDLE: // waiting for events
 		// allow serial events
-		serial_rx_next();
-		serial_tx_next();
+		serial_set(0);
 
 		// change shared state to init
 		change(s, INIT);
@@ -182,20 +184,23 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 
 	// transmitted packet
 	if (arg->flags & TX) {
-		serial_tx_next(); // allow next packet to transmit
+		return 0; // nothing to do
 
 	// has to be a received packet
 	} else {
 		packet_t tmp;
 
+		// responses echo the sequence number of the request
+		tmp.seq = arg->target->seq;
+
 		// handle packets
-		switch (arg->target.type) {
+		switch (arg->target->type) {
 		// manual state sync
 		case SYNC:
 			// prepare response
 			tmp.type = SYNC;
 			tmp.mode = RESPONSE;
-			tmp.header.response.status = OK;
+			tmp.header.response.status = RESP_OK;
 			tmp.content.sync.now = sstate;
 
 			// transmit response
@@ -209,14 +214,14 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 
 			// frontend can initiate state change when unlocked
 			if (sstate == ULCK) {
-				tmp.header.response.status = OK;
+				tmp.header.response.status = RESP_OK;
 			
 				// dispatch state change and let
 				// the handler sync shared state
-				change(s, arg->target.content.change.now);
+				change(s, arg->target->content.change.now);
 
 			} else {
-				tmp.header.response.status = FAIL;
+				tmp.header.response.status = RESP_FAIL;
 			}
 			
 			// transmit response
@@ -229,14 +234,14 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 			tmp.mode = RESPONSE;
 
 			// check code
-			if (check_code(arg->target.content.chkcode.code)) {
-				tmp.header.response.status = OK;
+			if (check_code(arg->target->content.chkcode.code)) {
+				tmp.header.response.status = RESP_OK;
 
 				// change state to unlocked
 				change(s, ULCK);
 
 			} else {
-				tmp.header.response.status = FAIL;
+				tmp.header.response.status = RESP_FAIL;
 			}
 
 			// transmit response
@@ -252,27 +257,49 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 			if (sstate == ULCK) {
 				// try to change
 				if (change_code(
-					arg->target.content.newcode.old_code,
-					arg->target.content.newcode.new_code)
+					arg->target->content.newcode.old_code,
+					arg->target->content.newcode.new_code)
 				) {
-					tmp.header.response.status = OK;
+					tmp.header.response.status = RESP_OK;
 
 				// invalid old code
 				} else {
-					tmp.header.response.status = FAIL;
+					tmp.header.response.status = RESP_FAIL;
 				}
 			
 			// acknowledge with error
 			} else {
-				tmp.header.response.status = FAIL;
+				tmp.header.response.status = RESP_FAIL;
 			}
 
 			// transmit response
 			serial_tx(&tmp, 0);
 			break;
+
+#ifdef EVENT_TRACE
+		// flight recorder dump (entries are for a tap on the link)
+		case TRACE:
+			if (arg->target->mode == REQUEST)
+				trace_dump();
+			break;
+#endif
+
+#ifdef SLEEP_STATS
+		// power counters (messages are for a tap on the link)
+		case POWER:
+			if (arg->target->mode == REQUEST)
+				power_dump();
+			break;
+#endif
+
+#ifdef EVENT_PROFILE
+		// profile of the other board (for a tap on the link)
+		case PROFILE:
+			break;
+#endif
 		}
 
-		serial_rx_next(); // allow next packet to be received
+		serial_rx_next(); // done with received packet
 	}
 
 	return 0;
@@ -297,51 +324,44 @@ u8 e_motion_trigger(u8 unused id, u8 unused code, ptr unused arg)
 	return 0;
 }
 
-// timer event handler
-u8 e_program_timer(u8 id, u8 unused code, ptr unused arg)
+// alarm timeout timer
+static void alert_timeout(stimer_t unused *t)
 {
-	// wait
-	if (ticks-- > 0)
-		return 0;
+	// trigger alarm (cancelled if unlocked in time)
+	if (sstate == ALRT)
+		change(s, ALRM);
+}
 
-	// internal state overrides shared state
-	switch (istate) {
-	// boot state (turning on)
-	case BOOT:
-		// switch to on
-		if (boot_sequence()) {
-			// change state
-			change(i, IDLE);
-
-			// disable self
-			ev_set_id(id, 1);
-		}
-		break;
+// idle hook, writes the changed code into EEPROM a byte at a time
+// (a write takes 3.3ms, a step never waits for the previous one)
+u8 e_code_persist(u8 unused id, u8 unused code, ptr unused arg)
+{
+	u8 *mem = (u8 *)&code_mem;
+	u8 *ram = (u8 *)&code_ram;
 
-	// waiting state (on)
-	case IDLE:
-		switch (sstate) {
-		// trigger alarm on timeout
-		case ALRT:
-			// dispatch state change
-			change(s, ALRM);
+	// nothing to write
+	if (likely(!code_dirty))
+		return EVENT_NEXT;
 
-			ev_set_id(id, 1); // stop
-			break;
-		
-		// not configured
-		default:
-			ev_set_id(id, 1); // stop
-			break;
+	// previous write in progress
+	if (!eeprom_is_ready())
+		return EVENT_AGAIN;
+
+	for (u8 i = 0; i < sizeof(code_ram); i++) {
+		if (eeprom_read_byte(&mem[i]) != ram[i]) {
+			eeprom_write_byte(&mem[i], ram[i]);
+			return EVENT_AGAIN;
 		}
 	}
 
-	return 0;
+	// all written
+	code_dirty = 0;
+	return EVENT_NEXT;
 }
 
 // initial event (can't use dispatch() as .init section code
 // stack isn't addressable by functions for some reason)
-static const event_t boot_event PROGMEM = { STATE, &stev_istate };
+static const stev_t boot_state PROGMEM = { .type = INTERNAL, .now = BOOT };
 INIT()
 {
 #if 0
@@ -353,5 +373,5 @@ INIT()
 	code_ram = eeprom_read_word(&code_mem);
 
 	// dispatch boot event
-	(void)event_dispatch(&g_event_loop, &boot_event, ROMDATA);
+	(void)event_dispatch(&g_event_loop, STATE, &boot_state, ROMDATA);
 }
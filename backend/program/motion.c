@@ -1,9 +1,13 @@
 #include "globals.h"
 #include "util/init.h"
 #include "util/interrupt.h"
+#include "common/timer.h"
+#include "common/power.h"
 #include "program/motion.h"
 
-static u8 ticks;
+static void motion_rearm(stimer_t *t);
+
+static stimer_t debounce = stimer_init(motion_rearm);
 
 void motion_set(u8 disable)
 {
@@ -14,8 +18,7 @@ void motion_set(u8 disable)
 		PCMSK2 &= ~_BV(PCINT19);
 
 		// reset debounce timer
-		ticks = 0;
-		ev_set_id(MOTION_TIMER, 1);
+		stimer_cancel(&debounce);
 	} else {
 		// enable interrupt
 		PCMSK2 |= _BV(PCINT19);
@@ -26,6 +29,8 @@ void motion_set(u8 disable)
 
 ISR(PCINT2_vect)
 {
+	power_woke(WAKE_PCINT);
+
 	// we don't care about the high transition
 	if (PIND & _BV(3))
 		return;
@@ -35,22 +40,13 @@ ISR(PCINT2_vect)
 
 	// re-enable ISR with timer
 	PCMSK2 &= ~_BV(PCINT19);
-	ticks = MOTION_WAIT_TICKS;
-	ev_set_id(MOTION_TIMER, 0);
+	stimer_arm(&debounce, MOTION_WAIT_TICKS, 0);
 }
 
-u8 e_motion_timer(u8 id, u8 unused code, ptr unused arg)
+static void motion_rearm(stimer_t unused *t)
 {
-	if (ticks-- > 0)
-		return 0;
-	
-	// disable self
-	ev_set_id(id, 1);
-
 	// enable ISR
 	PCMSK2 |= _BV(PCINT19);
-
-	return 0;
 }
 
 INIT()
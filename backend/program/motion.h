@@ -4,7 +4,7 @@
 #include "util/type.h"
 
 // motion sensor debounce
-#define MOTION_WAIT_TICKS 2
+#define MOTION_WAIT_TICKS 3
 
 // set motion detector state
 void motion_set(u8 disable);
@@ -2,6 +2,8 @@
 #include "util/init.h"
 #include "util/memory.h"
 #include "util/interrupt.h"
+#include "common/timer.h"
+#include "common/power.h"
 #include "program/button.h" 
 
 #include <avr/cpufunc.h>
@@ -58,8 +60,6 @@ static volatile struct {
 		u16 state; // button state
 		u16 flags; // other stuff
 	} packed out;
-	u8 t1; // tick counter 1
-	u8 t2; // tick counter 2
 #define WAIT 0
 #define POLL 1
 #define LOCK 2
@@ -67,6 +67,9 @@ static volatile struct {
 	u8 state; // internal state
 } packed state;
 
+// current output as event payload (event type in high word)
+#define out() (((u32)state.out.flags << 16) | state.out.state)
+
 // PORTK pins (cast braindamage)
 #define COLS ((u8)((u8)~0 >> 4))
 #define ROWS ((u8)((u8)~0 << 4))
@@ -116,107 +119,106 @@ static u16 scan()
 	return result;
 }
 
-u8 e_button_timer(u8 unused id, u8 unused code, ptr unused arg)
+static void button_poll(stimer_t *t);
+static void button_scan(stimer_t *t);
+static void button_jitter(stimer_t *t);
+static void button_hold(stimer_t *t);
+static void button_inactive(stimer_t *t);
+
+/* state machine timers */
+static stimer_t t_poll   = stimer_init(button_poll);     // POLL -> LOCK
+static stimer_t t_scan   = stimer_init(button_scan);     // LOCK (every tick)
+static stimer_t t_jitter = stimer_init(button_jitter);   // LOCK -> IACT
+static stimer_t t_hold   = stimer_init(button_hold);     // LOCK (HOLD event)
+static stimer_t t_iact   = stimer_init(button_inactive); // IACT -> WAIT
+
+// polled for BTN_POLL_TICKS
+static void button_poll(stimer_t unused *t)
 {
 	save_int();
 
-	/* button state machine */
-	switch (state.state) {
-	case WAIT:
-		// the timer should never run here
-		ev_set_id(BUTTON_TIMER, 1);
-		break;
-	
-	case POLL:
-		// wait for BTN_POLL_TICKS
-		if (state.t1-- > 0)
-			break;
-
-		// dispatch DOWN event
-		state.out.flags = DOWN >> 16;
-		dispatch(BUTTON, (ptr)&state.out);
-
-		// lock state
-		state.t1 = 0x7F; // jitter counter
-		state.t2 = BTN_HOLD_TICKS; // hold counter
-		PCMSK2 = 0; // mask interrupts
-		state.state = LOCK;
-		break;
-	
-	case LOCK:
-		// detected possible jitter
-		if (state.t1 != 0x7F) {
-			if (state.t1 < 1) {
-				// state mismatch after jitter timeout
-				if (scan() != state.out.state) {
-					// if holding, dispatch HLUP
-					if (state.out.flags & (HOLD >> 16))
-						state.out.flags = HLUP >> 16;
-					// otherwise dispatch UP
-					else
-						state.out.flags = UP >> 16;
-					dispatch(BUTTON, (ptr)&state.out);
-
-					// inactive state
-					state.t1 = BTN_INACTIVE_TICKS;
-					state.state = IACT;
-					break;
-
-				// invalidate jitter counter
-				} else {
-					state.t1 = 0x7F;
-				}
-			} else {
-				state.t1--;
-			}
-		} else {
-			// state mismatch
-			if (scan() != state.out.state)
-				state.t1 = BTN_JITTER_TICKS; // start
-		}
-	
-		// hold state
-		if (state.t2 < 1) {
-			// dispatch HOLD event
-			state.out.flags = HOLD >> 16;
-			dispatch(BUTTON, (ptr)&state.out);
-			
-			// invalidate
-			state.t2 = 0x7F;
-		} else {
-			// decrement if not invalidated
-			if (state.t2 != 0x7F)
-				state.t2--;
-		}
+	// dispatch DOWN event
+	state.out.flags = DOWN >> 16;
+	dispatch(BUTTON, out());
 
-		break;
-	
-	case IACT:
-		// wait for BTN_INACTIVE_TICKS
-		if (state.t1-- > 0)
-			break;
+	// lock state
+	PCMSK2 = 0; // mask interrupts
+	state.state = LOCK;
+	stimer_arm(&t_scan, 1, 1);
+	stimer_arm(&t_hold, BTN_HOLD_TICKS, 0);
 
-		// wait state
-		ev_set_id(BUTTON_TIMER, 1);
-		PCMSK2 = COLS;
-		state.state = WAIT;
+	rest_int();
+}
 
-		break;
-	}
+// look for state mismatch in lock state
+static void button_scan(stimer_t unused *t)
+{
+	// detected possible jitter
+	if (stimer_armed(&t_jitter))
+		return;
+
+	// state mismatch
+	if (scan() != state.out.state)
+		stimer_arm(&t_jitter, BTN_JITTER_TICKS, 0); // start
+}
+
+// jitter timeout
+static void button_jitter(stimer_t unused *t)
+{
+	save_int();
 
+	// state matches again (jitter)
+	if (scan() == state.out.state)
+		goto end;
+
+	// if holding, dispatch HLUP
+	if (state.out.flags & (HOLD >> 16))
+		state.out.flags = HLUP >> 16;
+	// otherwise dispatch UP
+	else
+		state.out.flags = UP >> 16;
+	dispatch(BUTTON, out());
+
+	// inactive state
+	stimer_cancel(&t_scan);
+	stimer_cancel(&t_hold);
+	stimer_arm(&t_iact, BTN_INACTIVE_TICKS, 0);
+	state.state = IACT;
+end:
 	rest_int();
+}
+
+// held for BTN_HOLD_TICKS
+static void button_hold(stimer_t unused *t)
+{
+	save_int();
 
-	return 0;
+	// dispatch HOLD event
+	state.out.flags = HOLD >> 16;
+	dispatch(BUTTON, out());
+
+	rest_int();
+}
+
+// inactive for BTN_INACTIVE_TICKS
+static void button_inactive(stimer_t unused *t)
+{
+	save_int();
+
+	// wait state
+	PCMSK2 = COLS;
+	state.state = WAIT;
+
+	rest_int();
 }
 
 // TODO: implement pin change interrupt cooldown with timer
 
-ISR(PCINT2_vect)
+// pin change (deferred from the ISR, pin changes are masked until here)
+static void button_change(u8 unused arg)
 {
 	u16 temp;
 
-	PCMSK2 = 0;
-
 	switch (state.state) {
 	case WAIT:
 		// scan buttons
@@ -230,11 +232,8 @@ ISR(PCINT2_vect)
 		state.out.state = temp;
 
 		// start polling
-		state.t1 = BTN_POLL_TICKS;
 		state.state = POLL;
-
-		// start timer
-		ev_set_id(BUTTON_TIMER, 0);
+		stimer_arm(&t_poll, BTN_POLL_TICKS, 0);
 out:
 		PCMSK2 = COLS;
 		break;
@@ -247,6 +246,18 @@ out:
 	}
 }
 
+ISR(PCINT2_vect)
+{
+	power_woke(WAKE_PCINT);
+
+	// scanning takes a while, leave it to the main loop
+	PCMSK2 = 0;
+
+	// lose the change rather than the keypad
+	if (defer(button_change, 0))
+		PCMSK2 = COLS;
+}
+
 INIT()
 {
 	DDRK   = ROWS; // rows -> output, cols -> input
@@ -5,19 +5,19 @@
 // timer frequency is altered. (10Hz at the moment)
 
 // how many ticks to poll for button state
-#define BTN_POLL_TICKS 2
+#define BTN_POLL_TICKS 3
 
 // how many ticks can the state differ from a locked
 // state before it's registered as a new event
-#define BTN_JITTER_TICKS 1
+#define BTN_JITTER_TICKS 2
 
 // how many ticks until the hold state is activated
 // (triggers a HOLD event and when released HLUP)
-#define BTN_HOLD_TICKS 9
+#define BTN_HOLD_TICKS 10
 
 // how many ticks after an event until a new event
 // can be registered
-#define BTN_INACTIVE_TICKS 1
+#define BTN_INACTIVE_TICKS 2
 
 // key names (use as mask for event state)
 #define K0 (1UL <<  8)
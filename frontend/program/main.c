@@ -2,6 +2,10 @@
 #include "util/init.h"
 #include "util/interrupt.h"
 #include "common/serial.h"
+#include "common/timer.h"
+#include "common/trace.h"
+#include "common/power.h"
+#include "util/task.h"
 #include "program/screen.h"
 #include "program/button.h" 
 
@@ -9,165 +13,191 @@
 static sstate_t sstate = INIT;
 static istate_t istate = BOOT;
 
-// event data for each type
-static stev_t stev_sstate = { .type = SHARED   };
-static stev_t stev_istate = { .type = INTERNAL };
+// state change event type for each state
+#define stev_s SHARED
+#define stev_i INTERNAL
 
 // how long to keep messages on screen
-#define MSG_TICKS 10
+#define MSG_TICKS 11
 
 // flags for the main program
 #define HAVELINK (1 << 0) // link status
 #define SSRECALL (1 << 1) // state change during boot
 static u8 flags;
 
+// requests sent again since the last response
+static u8 retries;
+
 // state change dispatcher
-#define change(what, to) ({ \
-	stev_##what##state.old = what##state; \
-	stev_##what##state.now = to; \
-	dispatch(STATE, &stev_##what##state); })
+#define change(what, to) \
+	dispatch(STATE, ((stev_t){ \
+		.type = stev_##what, .old = what##state, .now = (to) }))
 
-// how long until we assume the serial link is broken
-#define SERIAL_TIMEOUT_TICKS 5
+// how long to wait for a response before sending the requests
+// again, and how often until we assume the serial link is broken
+#define SERIAL_TIMEOUT_TICKS 3
+#define SERIAL_RETRIES 1
 
 // how often to send sync (detectes link loss)
-#define SYNC_INTERVAL_TICKS 20
+#define SYNC_INTERVAL_TICKS 21
+
+static void program_timer(stimer_t *t);
+static void serial_timeout(stimer_t *t);
+static void stsync_timer(stimer_t *t);
+
+// software timers
+static stimer_t prog = stimer_init(program_timer); // changes between users
+static stimer_t tout = stimer_init(serial_timeout);
+static stimer_t sync = stimer_init(stsync_timer);
+
+TASK(code_entry);
+
+// multi-step sequences (boot and idle animations are below)
+static task_t entry = task_init(code_entry); // CODE state input
 
 // serial transmission helper with timeout
+// (runs from the first unanswered packet)
 #define tx(packet, flags) ({ \
-	ev_set_id(SERIAL_TIMEOUT, 0); \
+	if (!stimer_armed(&tout)) \
+		stimer_arm(&tout, SERIAL_TIMEOUT_TICKS, 0); \
 	serial_tx(packet, flags); \
 	})
 
-// tick counters for different timers
-static u8 ticks; // changes between users
-static u8 tout_ticks = SERIAL_TIMEOUT_TICKS;
-static u8 sync_ticks; // should start at zero
-
 // code input state
 static u16 code_input;
 static u8  code_index;
-static u8  code_stage;
 
-#define FRAME_TICKS 0
-#define TITLE_TICKS 20
+#define FRAME_TICKS 1
+#define TITLE_TICKS 21
 
 // cool boot animation, because why not
 static const chr boot_text_1[SCREEN_COLS] PROGMEM = "  ALARM SYSTEM  ";
 static const chr boot_text_2[SCREEN_COLS] PROGMEM = "    J.OVASKA    ";
 
-static u8 boot_counter;
-
-static u8 boot_sequence()
+// boot animation (changes to IDLE or LINK when done)
+TASK(boot_animation)
 {
-	// init
-	if (unlikely(boot_counter == 0)) {
-		screen_clear();
-		ev_set_id(PROGRAM_TIMER, 0);
-	}
+	static u8 col;
+
+	task_begin();
+
+	screen_clear();
 
 	// reveal
-	if (boot_counter < SCREEN_COLS) {
+	for (col = 0; col < SCREEN_COLS; col++) {
 		// line 1
-		if (boot_counter > 0) {
-			screen_goto(0, boot_counter - 1);
-			screen_putc(rom(boot_text_1[boot_counter - 1], byte), 0);
+		if (col > 0) {
+			screen_goto(0, col - 1);
+			screen_putc(rom(boot_text_1[col - 1], byte), 0);
 		} else {
-			screen_goto(0, boot_counter);
+			screen_goto(0, col);
 		}
 		screen_putc('#', 0);
 
 		// line 2
-		screen_goto(1, SCREEN_COLS - 1 - boot_counter);
+		screen_goto(1, SCREEN_COLS - 1 - col);
 		screen_putc('#', 0);
-		if (boot_counter > 0)
-			screen_putc(rom(boot_text_2[SCREEN_COLS - boot_counter], byte), 0);
+		if (col > 0)
+			screen_putc(rom(boot_text_2[SCREEN_COLS - col], byte), 0);
 
-		ticks = FRAME_TICKS;
-	
-	// keep text
-	} else if (boot_counter == SCREEN_COLS) {
-		// line 1
-		screen_goto(0, 15);
-		screen_putc(' ', 0);
+		screen_flush();
+		task_sleep(FRAME_TICKS);
+	}
 
-		// line 2
-		screen_goto(1, 0);
-		screen_putc(' ', 0);
+	// keep text
+	screen_goto(0, 15);
+	screen_putc(' ', 0);
+	screen_goto(1, 0);
+	screen_putc(' ', 0);
+	screen_flush();
+	task_sleep(TITLE_TICKS);
 
-		ticks = TITLE_TICKS;
-	
 	// hide
-	} else if (boot_counter < 2*SCREEN_COLS) {
+	for (col = 1; col < SCREEN_COLS; col++) {
 		// line 1
-		screen_goto(0, 2*SCREEN_COLS - boot_counter - 1);
+		screen_goto(0, SCREEN_COLS - col - 1);
 		screen_putc('#', 0);
-		if (boot_counter > (SCREEN_COLS + 1))
+		if (col > 1)
 			screen_putc(' ', 0);
 
 		// line 2
-		if (boot_counter > (SCREEN_COLS + 1)) {
-			screen_goto(1, boot_counter - SCREEN_COLS - 1);
+		if (col > 1) {
+			screen_goto(1, col - 1);
 			screen_putc(' ', 0);
 		} else {
-			screen_goto(1, boot_counter - SCREEN_COLS);
+			screen_goto(1, col);
 		}
 		screen_putc('#', 0);
 
-		ticks = FRAME_TICKS;
-	
-	// end of animation
-	} else {
-		// line 1
-		screen_goto(0, 0);
-		screen_putc(' ', 0);
-
-		// line 2
-		screen_goto(1, 15);
-		screen_putc(' ', 0);
-
 		screen_flush();
-
-		boot_counter = 0;
-		return 1;
+		task_sleep(FRAME_TICKS);
 	}
 
-	// commit to display
+	// end of animation
+	screen_goto(0, 0);
+	screen_putc(' ', 0);
+	screen_goto(1, 15);
+	screen_putc(' ', 0);
 	screen_flush();
 
-	boot_counter++;
-	return 0;
+	// we have a link
+	if (flags & HAVELINK)
+		change(i, IDLE);
+
+	// otherwise go to no link state
+	else
+		change(i, LINK);
+
+	task_end();
 }
 
-#define ANIM_TICKS 10
+static task_t boot = task_init(boot_animation);
+
+#define ANIM_TICKS 11
 
 static const chr idle_text[] PROGMEM = "PRESS ANY KEY";
 
 // __builtin_strlen() will hopefully eval at compile time 
 #define MOVEMENT (SCREEN_COLS - __builtin_strlen(idle_text))
 
-static u8 anim_counter;
-
-static void idle_animation()
+// idle animation (text bounces on line 2 until stopped)
+TASK(idle_animation)
 {
-	if (anim_counter < 1) {
+	static u8 pos;
+
+	task_begin();
+
+	while (1) {
+		// right
 		screen_goto(1, 0);
 		screen_puts((ptr)idle_text, NULLTERM, ROMSTR);
 		screen_putc(' ', 0);
-	} else if (anim_counter <= MOVEMENT) {
-		screen_goto(1, anim_counter - 1);
-		screen_putc(' ', 0);
-		screen_puts((ptr)idle_text, NULLTERM, ROMSTR);
-	} else {
-		screen_goto(1, 2*MOVEMENT - anim_counter);
-		screen_puts((ptr)idle_text, NULLTERM, ROMSTR);
-		screen_putc(' ', 0);
+		screen_flush();
+		task_sleep(ANIM_TICKS);
+
+		for (pos = 0; pos < MOVEMENT; pos++) {
+			screen_goto(1, pos);
+			screen_putc(' ', 0);
+			screen_puts((ptr)idle_text, NULLTERM, ROMSTR);
+			screen_flush();
+			task_sleep(ANIM_TICKS);
+		}
+
+		// left
+		for (pos = MOVEMENT - 1; pos > 0; pos--) {
+			screen_goto(1, pos);
+			screen_puts((ptr)idle_text, NULLTERM, ROMSTR);
+			screen_putc(' ', 0);
+			screen_flush();
+			task_sleep(ANIM_TICKS);
+		}
 	}
 
-	screen_flush();
-	anim_counter = (anim_counter + 1) % (2*MOVEMENT);  
+	task_end();
 }
 
+static task_t idle = task_init(idle_animation);
+
 #define DEF_PSTR_PTR(name, str) \
 	static const char PSTR_PTR_##name[] PROGMEM = (str)
 
@@ -251,12 +281,12 @@ static void sstate_change(sstate_t old, sstate_t now)
 	// recall after boot
 	if (unlikely(istate == BOOT)) {
 		flags |= SSRECALL;
-		return; 
+		goto done;
 	}
 
 	// race condition with no link
 	if (unlikely(istate == LINK))
-		return;
+		goto done;
 
 	// disable backlight blink
 	if (now != ALRM)
@@ -303,6 +333,7 @@ static void sstate_change(sstate_t old, sstate_t now)
 		break;
 	}
 
+done:
 	rest_int();
 }
 
@@ -328,7 +359,8 @@ static void istate_change(istate_t old, istate_t now)
 		screen_flush();
 
 		// reset state
-		code_input = code_index = code_stage = 0;
+		task_stop(&entry);
+		code_input = code_index = 0;
 		break;
 
 	case MENU: // main menu
@@ -338,7 +370,7 @@ static void istate_change(istate_t old, istate_t now)
 		break;
 
 	case IDLE: // idle state
-		ev_set_id(PROGRAM_TIMER, 1);
+		task_stop(&idle);
 		break;
 	}
 
@@ -356,7 +388,7 @@ static void istate_change(istate_t old, istate_t now)
 	// new state init
 	switch (now) {
 	case BOOT: // booting up
-		(void) boot_sequence();
+		task_start(&boot);
 		break;
 
 	case LINK: // waiting for link
@@ -373,6 +405,7 @@ static void istate_change(istate_t old, istate_t now)
 		screen_puts(PSTR("   * [    ] #   "), NULLTERM, ROMSTR);
 		screen_cursor(1, 6, BOTH);
 		screen_flush();
+		task_start(&entry); // waits for the first code
 		break;
 
 	case MENU: // main menu
@@ -384,10 +417,7 @@ static void istate_change(istate_t old, istate_t now)
 		break;
 
 	case IDLE: // idle state
-		anim_counter = 0;
-		ticks = ANIM_TICKS;
-		idle_animation();
-		ev_set_id(PROGRAM_TIMER, 0);
+		task_start(&idle);
 		ev_set_id(BUTTON_INPUT, 0);
 		break;
 	}
@@ -415,9 +445,6 @@ u8 e_state_change(u8 unused id, u8 unused code, stev_t *data)
 	return 0;
 }
 
-// last transmitted packet
-static packet_t *last_tx;
-
 // serial event handler
 u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 {
@@ -425,21 +452,16 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 	if (arg->flags & FAIL)
 		return 0;
 
-	// transmitted packet
+	// transmitted packet (up to SERIAL_WINDOW requests
+	// are answered at a time, see serial_retry())
 	if (arg->flags & TX) {
-		// messages are transmitted without timeout
-		if (arg->target.mode == REQUEST)
-			last_tx = &arg->target; // kept at least until serial_tx_next()
-
-		// no need to keep this packet
-		else
-			serial_tx_next();
+		return 0;
 
 	// has to be a received packet
 	} else {
-		// reset & stop timeout timer
-		tout_ticks = SERIAL_TIMEOUT_TICKS;
-		ev_set_id(SERIAL_TIMEOUT, 1);
+		// stop timeout timer
+		stimer_cancel(&tout);
+		retries = 0;
 
 		// set link flag
 		flags |= HAVELINK;
@@ -449,19 +471,19 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 			change(i, IDLE);
 
 		// handle packets
-		switch (arg->target.type) {
+		switch (arg->target->type) {
 		// manual state sync
 		case SYNC:
 			// initiate state change
-			if (sstate != arg->target.content.sync.now)
-				change(s, arg->target.content.sync.now);
+			if (sstate != arg->target->content.sync.now)
+				change(s, arg->target->content.sync.now);
 			break;
 
 		// state change
 		case CHANGE:
 			// message from backend
-			if (arg->target.mode == MESSAGE)
-				change(s, arg->target.content.change.now);
+			if (arg->target->mode == MESSAGE)
+				change(s, arg->target->content.change.now);
 			break;
 
 		// check code or new code
@@ -469,25 +491,44 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 		case NEWCODE:
 			// give feedback
 			screen_goto(1, 6);
-			if (arg->target.header.response.status == OK)
+			if (arg->target->header.response.status == RESP_OK)
 				screen_puts(PSTR(" OK "), NULLTERM, ROMSTR);
 			else
 				screen_puts(PSTR("FAIL"), NULLTERM, ROMSTR);
 			screen_flush();
 
 			// timeout to idle mode
-			ticks = MSG_TICKS;
-			ev_set_id(PROGRAM_TIMER, 0);
+			stimer_arm(&prog, MSG_TICKS, 0);
 			break;
-		}
 
-		// response packet clears this
-		if (arg->target.mode == RESPONSE) {
-			last_tx = NULL;
-			serial_tx_next();
+#ifdef EVENT_TRACE
+		// flight recorder dump (entries are for a tap on the link)
+		case TRACE:
+			if (arg->target->mode == REQUEST)
+				trace_dump();
+			break;
+#endif
+
+#ifdef SLEEP_STATS
+		// power counters (messages are for a tap on the link)
+		case POWER:
+			if (arg->target->mode == REQUEST)
+				power_dump();
+			break;
+#endif
+
+#ifdef EVENT_PROFILE
+		// profile of the other board (for a tap on the link)
+		case PROFILE:
+			break;
+#endif
 		}
 
-		serial_rx_next(); // allow next packet to be received
+		// other requests still wait for their responses
+		if (serial_waiting())
+			stimer_arm(&tout, SERIAL_TIMEOUT_TICKS, 0);
+
+		serial_rx_next(); // done with received packet
 	}
 
 	return 0;
@@ -495,40 +536,50 @@ u8 e_serial_packet(u8 unused id, u8 unused code, sev_t *arg)
 
 static packet_t my_packet;
 
-// code input handler
-u8 e_oncode_input(u8 unused id, u8 unused code, u16 *arg)
+// code entry (unlock code, or old and new code when unlocked)
+TASK(code_entry)
 {
-	// which code are we inputting
-	if (sstate == ULCK) {
-		if (code_stage < 1) {
-			// prepare part of packet
-			my_packet.type = NEWCODE;
-			my_packet.mode = REQUEST;
-			my_packet.content.newcode.old_code = *arg;
-
-			// update screen
-			screen_goto(1, 6);
-			screen_puts(PSTR("    "), NULLTERM, ROMSTR);
-			screen_goto(1, 6);
-			screen_flush();
-			screen_cursor(1, 6, BOTH);
+	task_begin();
 
-			// change button code state
-			code_stage++;
-			code_input = code_index = 0;
-			ev_set_id(BUTTON_INPUT, 0);
-		} else {
-			my_packet.content.newcode.new_code = *arg;
-			tx(&my_packet, 0);
-		}
-	} else {
-		// unlock code
+	// first code
+	task_wait();
+
+	// unlock code
+	if (sstate != ULCK) {
 		my_packet.type = CHKCODE;
 		my_packet.mode = REQUEST;
-		my_packet.content.chkcode.code = *arg;
+		my_packet.content.chkcode.code = *(u16 *)task->arg;
 		tx(&my_packet, 0);
+		task_exit();
 	}
 
+	// prepare part of packet
+	my_packet.type = NEWCODE;
+	my_packet.mode = REQUEST;
+	my_packet.content.newcode.old_code = *(u16 *)task->arg;
+
+	// update screen
+	screen_goto(1, 6);
+	screen_puts(PSTR("    "), NULLTERM, ROMSTR);
+	screen_goto(1, 6);
+	screen_flush();
+	screen_cursor(1, 6, BOTH);
+
+	// input new code
+	code_input = code_index = 0;
+	ev_set_id(BUTTON_INPUT, 0);
+	task_wait();
+
+	my_packet.content.newcode.new_code = *(u16 *)task->arg;
+	tx(&my_packet, 0);
+
+	task_end();
+}
+
+// code input handler
+u8 e_oncode_input(u8 unused id, u8 unused code, u16 *arg)
+{
+	task_resume(&entry, arg);
 	return 0;
 }
 
@@ -577,7 +628,6 @@ u8 e_button_input(u8 unused id, u8 unused code, u32 *arg)
 		if (*arg & KS) {
 			// last character --> back to idle mode
 			if (code_index < 1) {
-				code_stage = 0;
 				change(i, IDLE);
 				break;
 			}
@@ -607,7 +657,7 @@ u8 e_button_input(u8 unused id, u8 unused code, u32 *arg)
 				break;
 
 			// dispatch event
-			dispatch(ONCODE, &code_input);
+			dispatch(ONCODE, code_input);
 
 			// disable self
 			ev_set_id(id, 1);
@@ -645,7 +695,7 @@ u8 e_button_input(u8 unused id, u8 unused code, u32 *arg)
 		
 		// # is enter
 		} else if (*arg & KH) {
-			dispatch(SELECT, &menu_item);
+			dispatch(SELECT, menu_item);
 			ev_set_id(id, 1); // disable self
 
 		// other keys cycle menu
@@ -663,60 +713,33 @@ u8 e_button_input(u8 unused id, u8 unused code, u32 *arg)
 	return 0;
 }
 
-// timer event handler
-u8 e_program_timer(u8 unused id, u8 unused code, ptr unused arg)
+// program timer (one-shot, handling sets the next wait)
+static void program_timer(stimer_t unused *t)
 {
-	// wait
-	if (ticks-- > 0)
-		return 0;
-
 	// internal state overrides shared state
 	switch (istate) {
-	// boot state (turning on)
-	case BOOT:
-		// switch to on
-		if (boot_sequence()) {
-			// we have a link
-			if (flags & HAVELINK)
-				change(i, IDLE);
-
-			// otherwise go to no link state
-			else
-				change(i, LINK);
-
-			// disable self
-			ev_set_id(id, 1);
-		}
-		break;
-	
 	// switch to idle mode and activate buttons
 	case CODE:
 		ev_set_id(BUTTON_INPUT, 0);
 		change(i, IDLE);
 		break;
 	
-	// idle animation
-	case IDLE:
-		idle_animation();
-		ticks = ANIM_TICKS;
-		break;
-	
 	// not configured
 	default:
-		ev_set_id(id, 1); // stop
 		break;
 	}
-
-	return 0;
 }
 
 // serial timeout (separate from program timer)
-u8 e_serial_timeout(u8 id, u8 unused code, ptr unused arg)
+static void serial_timeout(stimer_t unused *t)
 {
-	// wait
-	if (tout_ticks-- > 0)
-		return 0;
-	tout_ticks = SERIAL_TIMEOUT_TICKS;
+	// send unanswered requests again first
+	if (retries < SERIAL_RETRIES && serial_retry()) {
+		retries++;
+		stimer_arm(&tout, SERIAL_TIMEOUT_TICKS, 0);
+		return;
+	}
+	retries = 0;
 
 	// switch to no link state
 	if ((istate != BOOT) && (istate != LINK))
@@ -725,43 +748,31 @@ u8 e_serial_timeout(u8 id, u8 unused code, ptr unused arg)
 	// clear link flag
 	flags &= ~HAVELINK;
 
-	// clear last transmitted
-	last_tx = NULL;
-
-	// allow next packet to be transmitted
-	serial_tx_next();
-
-	ev_set_id(id, 1); // disable self
-
-	return 0;
+	// give up on unanswered requests
+	serial_abort();
 }
 
 // this remains static
 static const packet_t sync_packet PROGMEM = { .type = SYNC, .mode = REQUEST };
 
-// state synchronizer
-u8 e_stsync_timer(u8 unused id, u8 unused code, ptr unused arg)
+// state synchronizer (periodic)
+static void stsync_timer(stimer_t unused *t)
 {
-	// wait
-	if (sync_ticks-- > 0)
-		return 0;
-	sync_ticks = SYNC_INTERVAL_TICKS;
-
 	// transmit
 	tx((ptr)&sync_packet, ROMDATA);
-
-	return 0;
 }
 
 // initial event (can't use dispatch() as .init section code
 // stack isn't addressable by functions for some reason)
-static const event_t boot_event PROGMEM = { STATE, &stev_istate };
+static const stev_t boot_state PROGMEM = { .type = INTERNAL, .now = BOOT };
 INIT()
 {
 	// enable serial
-	serial_rx_next();
-	serial_tx_next();
+	serial_set(0);
+
+	// first sync on the first tick
+	stimer_arm(&sync, 1, SYNC_INTERVAL_TICKS);
 
 	// send initial state change
-	(void)event_dispatch(&g_event_loop, &boot_event, ROMDATA);
+	(void)event_dispatch(&g_event_loop, STATE, &boot_state, ROMDATA);
 }
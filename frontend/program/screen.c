@@ -2,6 +2,7 @@
 #include "util/init.h"
 #include "util/interrupt.h"
 #include "common/wait.h"
+#include "common/timer.h"
 #include "program/screen.h" 
 
 #include <avr/cpufunc.h>
@@ -101,6 +102,9 @@ static struct {
 	// current row and column
 	u8 row;
 	u8 col;
+
+	// buffer has changes to write
+	u8 dirty;
 } packed state;
 
 void screen_reset()
@@ -391,7 +395,20 @@ void screen_goto(u8 row, u8 col)
 
 void screen_flush()
 {
-	u8 old_row, old_col, cur_row, cur_col;	
+	// written by e_screen_flush() in steps that fit the handler budget
+	state.dirty = 1;
+}
+
+// idle hook, writes changed characters (as many as the budget allows)
+u8 e_screen_flush(u8 unused id, u8 unused code, ptr unused arg)
+{
+	u8 old_row, old_col, cur_row, cur_col;
+	u8 r = EVENT_NEXT;
+	u8 n = 0;
+
+	// nothing to write
+	if (likely(!state.dirty))
+		return EVENT_NEXT;
 
 	// get DDRAM address
 	screen_wait();
@@ -412,12 +429,21 @@ void screen_flush()
 			// no change
 			if (likely(*src == *dst))
 				continue;
+
+			// out of budget (at least one per step), rest in the next
+			// step (written characters match the flushed state)
+			if (n++ && ev_over()) {
+				r = EVENT_AGAIN;
+				goto restore;
+			}
 			
 			// cursor must be moved (change DDRAM address)
 			if (unlikely((cur_col != col) || (cur_row != row))) {
 				u8 data = INS_SDDA | DDRAM_ADDR(GET_ADDR(row, col));
 				screen_wait();
 				screen_io(WIR, &data);
+				cur_row = row;
+				cur_col = col;
 			}
 
 			// write character on screen
@@ -430,44 +456,43 @@ void screen_flush()
 		}
 	}
 
+	// all written
+	state.dirty = 0;
+restore:
 	// restore old cursor position
 	old_row = INS_SDDA | DDRAM_ADDR(GET_ADDR(old_row, old_col));
 	screen_wait();
 	screen_io(WIR, &old_row);
+
+	return r;
 }
 
 // BACKLIGHT CONTROL
 
-static u8 ticks;
+static void screen_blink(stimer_t *t);
+
+static stimer_t blink = stimer_init(screen_blink);
 
 void screen_backlight(bls_t state)
 {
 	switch (state) {
 	case OFF:
-		ev_set_id(SCREEN_BLINK, 1);
+		stimer_cancel(&blink);
 		PORTL &= ~_BV(3); // backlight off
 		break;
 	case ON:
-		ev_set_id(SCREEN_BLINK, 1);
+		stimer_cancel(&blink);
 		PORTL |= _BV(3); // backlight on
 		break;
 	case BLINK:
-		ev_set_id(SCREEN_BLINK, 0);
-		ticks = SCREEN_BLINK_TICKS;
+		stimer_arm(&blink, SCREEN_BLINK_TICKS, SCREEN_BLINK_TICKS);
 		break;
 	}
 }
 
-u8 e_screen_blink(u8 unused id, u8 unused code, u8 unused arg)
+static void screen_blink(stimer_t unused *t)
 {
-	// wait for specified amount of ticks
-	if (ticks-- > 0)
-		return 0;
-	ticks = SCREEN_BLINK_TICKS;
-
 	PINL |= _BV(3); // toggle backlight
-
-	return 0;
 }
 
 INIT()
@@ -5,7 +5,7 @@
 #include "util/type.h"
 
 // how many ticks to wait before changing blink state
-#define SCREEN_BLINK_TICKS 5
+#define SCREEN_BLINK_TICKS 6
 
 // LOW LEVEL IO
 
@@ -95,6 +95,7 @@ void screen_cursor(u8 row, u8 col, cursor_t cursor);
 
 void screen_goto(u8 row, u8 col);
 
+// write buffer changes to the screen (later, when the main loop is idle)
 void screen_flush();
 
 // BACKLIGHT CONTROL
@@ -0,0 +1,128 @@
+#include "globals.h"
+#include "util/sleep.h"
+#include "util/interrupt.h"
+#include "common/timer.h"
+#include "common/serial.h"
+#include "common/power.h"
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+#ifdef SLEEP_STATS
+power_stats_t g_power;
+volatile u8 g_asleep;
+
+/* The counters are sent one per POWER message on request, trace.py in the
+ * repository root decodes them (awake/asleep ratio, wakeups by source).
+ */
+
+static void power_send(stimer_t *t);
+
+static stimer_t timer = stimer_init(power_send);
+static packet_t packet = {
+	.type = POWER,
+	.mode = MESSAGE,
+	.content.power.count = POWER_STATS
+};
+
+// send as many counters as the serial buffer takes (every tick)
+static void power_send(stimer_t *t)
+{
+	u8 *i = &packet.content.power.index;
+
+	while (*i < POWER_STATS) {
+		// ISRs count wakeups
+		save_int();
+		packet.content.power.value = ((u32 *)&g_power)[*i];
+		rest_int();
+
+		// serial_tx() copies the packet
+		if (serial_tx(&packet, 0))
+			return; // full, continue on next tick
+
+		(*i)++;
+	}
+
+	// done
+	stimer_cancel(t);
+}
+
+void power_dump()
+{
+	// already sending
+	if (stimer_armed(&timer))
+		return;
+
+	packet.content.power.index = 0;
+	packet.content.power.shift = timer_shift();
+	stimer_arm(&timer, 1, 1);
+}
+#endif
+
+// SMCR sleep mode of each power mode
+static const u8 modes[POWER_MODES] PROGMEM = {
+	[POWER_IDLE] = SLEEP_MODE_IDLE,
+	[POWER_DOWN] = SLEEP_MODE_PWR_DOWN
+};
+
+// held wake sources
+static volatile u8 held;
+
+void power_hold(u8 sources, u8 release)
+{
+	save_int();
+
+	if (release)
+		held &= ~sources;
+	else
+		held |= sources;
+
+	rest_int();
+}
+
+void power_sleep()
+{
+#ifdef SLEEP_STATS
+	static u16 woke; // when the CPU last woke up
+	u16 t;
+#endif
+	u8 mode;
+
+	cli();
+
+	// dispatched by an ISR after the loop looked, sleeping would leave it
+	// waiting for the next interrupt
+	if (ev_pending()) {
+		sei();
+		return;
+	}
+
+#ifdef SLEEP_STATS
+	t = timer_now();
+	g_power.awake += (u16)(t - woke);
+	g_asleep = 1;
+#endif
+
+	mode = held ? POWER_IDLE : POWER_DOWN;
+	set_sleep_mode(rom(modes[mode], byte));
+	sleep_enable();
+	if (mode == POWER_DOWN)
+		sleep_bod_disable();
+
+	// the instruction after sei() runs before any interrupt,
+	// so one that is pending wakes the CPU right away
+	sei();
+	sleep_cpu();
+	sleep_disable();
+
+#ifdef SLEEP_STATS
+	woke = timer_now();
+	g_power.asleep[mode] += (u16)(woke - t);
+	g_power.sleeps[mode]++;
+
+	// woken by an ISR without power_woke()
+	save_int();
+	power_woke(WAKE_OTHER);
+	rest_int();
+#endif
+}
@@ -0,0 +1,65 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include "util/type.h"
+
+// wake sources that need the IO clock, the CPU sleeps in IDLE while any of
+// them is held and goes into power-down (pin changes wake it) otherwise
+#define POWER_TIMER (1 << 0) // TIMER1 compare match (common/timer.c)
+#define POWER_RX    (1 << 1) // USART receiver (common/serial.c)
+#define POWER_TX    (1 << 2) // USART transmission (common/serial.c)
+#define POWER_TONE  (1 << 3) // TIMER0 tone output (backend program/alarm.c)
+
+// sleep modes (deepest last)
+#define POWER_IDLE  0
+#define POWER_DOWN  1
+#define POWER_MODES 2
+
+#ifdef SLEEP_STATS
+// wakeup sources (first instrumented ISR after a sleep)
+#define WAKE_TIMER   0 // TIMER1 compare match
+#define WAKE_RX      1 // USART receive complete
+#define WAKE_UDRE    2 // USART data register empty
+#define WAKE_PCINT   3 // pin change (keypad or motion sensor)
+#define WAKE_OTHER   4 // none of the above
+#define WAKE_SOURCES 5
+
+/* Residency and wakeup counters, all u32 so that they can be sent one by
+ * one (index = field offset / 4). Times are in TIMER1 counts (cycles =
+ * counts << shift), TIMER1 stops in power-down so only the time spent in
+ * the wakeup ISR counts there, and a stretch longer than the timer wraps
+ * (0.26s, 1s with TIMER_TICKLESS) is only counted modulo its period.
+ */
+typedef struct {
+	u32 awake;                 // time awake
+	u32 asleep[POWER_MODES];   // time asleep
+	u32 sleeps[POWER_MODES];   // times slept
+	u32 wakeups[WAKE_SOURCES]; // wakeups by source
+} packed power_stats_t;
+
+#define POWER_STATS (sizeof(power_stats_t) / sizeof(u32))
+
+extern power_stats_t g_power;
+extern volatile u8 g_asleep; // no ISR ran since the CPU went to sleep
+
+// count wakeup source (first thing in an ISR)
+#define power_woke(source) do { \
+	if (g_asleep) { \
+		g_asleep = 0; \
+		g_power.wakeups[(source)]++; \
+	} } while (0)
+
+// send counters over serial (POWER messages), ignored if already sending
+void power_dump();
+#else
+#define power_woke(source) do {} while (0)
+#endif
+
+// hold (or release) wake sources, safe to call from interrupts
+void power_hold(u8 sources, u8 release);
+
+// sleep in the deepest mode the held wake sources allow (main loop), returns
+// without sleeping if an interrupt buffered events since the loop ran
+void power_sleep();
+
+#endif // !POWER_H
@@ -0,0 +1,39 @@
+#include "globals.h"
+#include "util/init.h"
+#include "common/timer.h"
+#include "common/serial.h"
+
+#ifdef EVENT_PROFILE
+
+/* The handler profile table is streamed one entry at a time as PROFILE
+ * messages, the peer ignores them and a tap on the TX line of either board
+ * (or simavr) can collect the table. g_event_prof can also be dumped from
+ * simavr or a debugger directly.
+ */
+
+// ticks between profile entries
+#define PROFILE_TICKS 5
+
+static void profile_send(stimer_t *t);
+
+static stimer_t timer = stimer_init(profile_send);
+static packet_t packet = { .type = PROFILE, .mode = MESSAGE };
+
+static void profile_send(stimer_t unused *t)
+{
+	// serial_tx() copies the packet
+	packet.content.profile.shift = timer_shift();
+	packet.content.profile.prof  = g_event_prof[packet.content.profile.id];
+	(void) serial_tx(&packet, 0);
+
+	// next entry
+	if (++packet.content.profile.id >= _N_HANDLERS)
+		packet.content.profile.id = 0;
+}
+
+INIT()
+{
+	stimer_arm(&timer, PROFILE_TICKS, PROFILE_TICKS);
+}
+
+#endif // EVENT_PROFILE
@@ -2,8 +2,10 @@
 #include "util/init.h"
 #include "util/memory.h"
 #include "util/interrupt.h"
+#include "util/crc.h"
 #include "common/defs.h"
 #include "common/serial.h" 
+#include "common/power.h"
 
 // FIXME: this is slightly incomplete but it works as is
 
@@ -43,228 +45,799 @@
 
 #endif
 
+// transmitted frame (packets queued by the handlers of one event)
+typedef struct {
+	u8 size;  // wire bytes (packets, then CRC)
+	u8 count; // packets
+	u8 data[SERIAL_BATCH];
+} packed batch_t;
+
 // these have to be separate due to flexible members
 // (compiler braindamage, would work fine in theory)
-static volatile ring_t rx_buf = ring_init(packet_t, SERIAL_BUFSIZE);
-static volatile ring_t tx_buf = ring_init(packet_t, SERIAL_BUFSIZE);
+// rx_buf: RX ISR -> main loop, tx_buf: main loop -> UDRE ISR (the ISRs
+// also consume, but never at the same time as the masked main loop side)
+static volatile ring_t rx_buf = ring_init(frame_t, SERIAL_BUFSIZE);
+static volatile ring_t tx_buf = ring_init(batch_t, SERIAL_FRAMES);
+
+// where the wire bytes of a frame start (see frame_t), messages
+// have no sequence number so theirs start at its place
+#define FRAME_START offsetof(packet_t, header)
+#define frame_start(mode) (FRAME_START + !FRAME_SEQ(mode))
+
+_Static_assert(offsetof(packet_t, seq) == FRAME_START + 1 &&
+	offsetof(packet_t, content) == FRAME_START + 2,
+	"packet header has to be a byte");
+
+// request window slot of a sequence number
+#define WINDOW_MASK ((1 << SERIAL_WINDOW) - 1)
+#define slot_of(seq) ((seq) & WINDOW_MASK)
+
+// body size by packet type and mode, with BODY_VALID set (the rows of
+// optional types that aren't built are zero, so they are unknown)
+#define BODY_VALID 0x80
+#define _body(m) (BODY_VALID | sizeof(((packet_t *)0)->content.m))
+#define _none    BODY_VALID
+static const u8 bodies[][3] PROGMEM = {
+	//          REQUEST         RESPONSE      MESSAGE
+	[SYNC]    = { _none,          _body(sync),  _body(sync)   },
+	[CHANGE]  = { _body(change),  _none,        _body(change) },
+	[CHKCODE] = { _body(chkcode), _none,        _none         },
+	[NEWCODE] = { _body(newcode), _none,        _none         },
+#ifdef EVENT_TRACE
+	[TRACE]   = { _none,          _none,        _body(trace)  },
+#endif
+#ifdef EVENT_PROFILE
+	[PROFILE] = { _none,          _none,        _body(profile) },
+#endif
+#ifdef SLEEP_STATS
+	[POWER]   = { _none,          _none,        _body(power)  },
+#endif
+};
+#undef _body
+#undef _none
+
+serial_drops_t g_serial_drops;
+
+#ifdef INT_STATS
+u16 g_serial_rx; // longest RX ISR run
+#endif
+
+// requests in flight and responses to the latest requests (by slot),
+// retransmissions are sent from here
+static frame_t sent[1 << SERIAL_WINDOW];
+static frame_t replies[1 << SERIAL_WINDOW];
+static u16 asked[1 << SERIAL_WINDOW]; // CRC of the request of a reply
+
+// largest packet has to fit in a frame of its own
+_Static_assert(sizeof(frame_t) - FRAME_START <= SERIAL_BATCH,
+	"SERIAL_BATCH is too small");
+
+// frame being filled by the handlers of the running event (reserved
+// tx_buf slot) and where its last packet starts, main loop only
+static batch_t *batch;
+static u8 batch_last;
 
 // internal state machine
 static volatile struct {
 
-#define RX_DISPATCH (1 << 0) // received packet can dispatch event
-#define TX_DISPATCH (1 << 1) // transmitted packet can dispatch event
-#define TX_PROGRESS (1 << 2) // transmission in progress
-#define TX_BLOCKING (1 << 3) // transmission blocking
+#define TX_PROGRESS (1 << 0) // transmission in progress
+#define TX_COPY     (1 << 1) // retransmission (not from tx_buf)
+#define TX_ZERO     (1 << 2) // current COBS block ends at a zero
+#define TX_END      (1 << 3) // delimiter sent
+#define RX_SKIP     (1 << 4) // bad frame, discard up to the delimiter
+#define RX_NOISE    (1 << 5) // bad frames since the last good one
+#define RX_FULL     (1 << 6) // rx_buf ran out of slots for the frame
 
 	u8 flags; // state machine flags
 
-	// byte positions for interrupt handlers
+	// packet/frame bytes decoded/encoded so far
 	u8 rx_byte;
 	u8 tx_byte;
+	u8 tx_size; // wire bytes of the transmitted frame
 
-	// pointers to where bytes are being copied from/to
-	realpacket_t rx;
-	realpacket_t tx;
+	// received packet, header (FRAME_MORE while one is due), wire bytes
+	// (without CRC) and where they start in the slot
+	u8 rx_head;
+	u8 rx_size;
+	u8 rx_start;
 
-	// we can safely allocate these here
-	sev_t rx_ev;
-	sev_t tx_ev;
+	u8 rx_count; // packets of the received frame in slots (from the head)
+	u8 rx_tail;  // CRC bytes after the last packet
+
+	// bytes left in the current COBS block
+	u8 rx_left;
+	u8 tx_left;
+
+	u8 rx_code; // code of the current COBS block
+	u16 rx_crc; // CRC of the decoded bytes
+
+	// request window (bit = slot)
+	u8 tx_seq;  // sequence number of the next request
+	u8 rx_seq;  // sequence number of the latest request of the peer
+	u8 wait;    // requests waiting for a response
+	u8 resend;  // requests to transmit again
+	u8 replied; // replies to the requests in asked
+	u8 again;   // replies to transmit again
+
+	// packets are received into rx_buf, this one is
+	// only used when it's full
+	frame_t rx;
+
+	// where packet/frame bytes are being copied to/from (ring slots
+	// or the retransmission copies)
+	frame_t *rx_dst;
+	const u8 *tx_src;
 
 } packed state = {
 	.flags   = 0,
 	.rx_byte = 0,
 	.tx_byte = 0,
-	.rx      = { .s = {PREAMBLE, {}, POSTAMBLE} },  // rx packet data
-	.tx      = { .s = {PREAMBLE, {}, POSTAMBLE} },  // tx packet data
-	.rx_ev   = {}, // rx event data
-	.tx_ev   = {}, // tx event data
+	.tx_size = 0,
+	.rx_head = FRAME_MORE,
+	.rx_size = 0,
+	.rx_start = FRAME_START,
+	.rx_count = 0,
+	.rx_tail = 0,
+	.rx_left = 0,
+	.tx_left = 0,
+	.rx_code = 0,
+	.rx_crc  = CRC16_INIT,
+	.tx_seq  = 0,
+	.rx_seq  = (u8)~0, // (the peer starts at 0)
+	.wait    = 0,
+	.resend  = 0,
+	.replied = 0,
+	.again   = 0,
+	.rx      = {},
+	.rx_dst  = NULL,
+	.tx_src  = NULL,
 };
 
 // I know where these happen and I don't need constant reminders
 #pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wzero-length-bounds"
 #pragma GCC diagnostic ignored "-Wdiscarded-qualifiers"
 
-u8 serial_tx(packet_t *packet, u8 flags)
+/* COBS encoding on the fly, a block is a code byte (1 + its data bytes) and
+ * up to 254 non-zero data bytes, a code below 0xFF also stands for a zero
+ * after the block (except after the last one). Looking for the end of a
+ * block is the only loop and it passes over each byte once.
+ */
+
+// wire size of a packet in a frame of its own by its header (0 if the
+// type or mode is unknown)
+static u8 frame_size(u8 header)
 {
-	int ret = 1; // fail
+	u8 type = FRAME_TYPE(header), mode = FRAME_MODE(header);
+	u8 body;
 
-	save_int();
+	if (type >= length(bodies) || mode > MESSAGE)
+		return 0;
 
-	// operation in progress
-	if (state.flags & TX_PROGRESS) {
-		// add to buffer
-		ret = ring_put(&tx_buf, packet, flags) == NULL;
-		goto end;
+	// type isn't built
+	body = rom(bodies[type][mode], byte);
+	if (!(body & BODY_VALID))
+		return 0;
+
+	return 1 + FRAME_SEQ(mode) + (body & ~BODY_VALID) + 2;
+}
+
+// oldest slot of a window mask (mask can't be 0), seq is the sequence
+// number after the latest one (own requests or those of the peer)
+static u8 oldest(u8 mask, u8 seq)
+{
+	u8 slot = slot_of(seq);
+
+	// slots are taken in sequence order, seq's is the oldest one
+	while (!(mask & (1 << slot)))
+		slot = slot_of(slot + 1);
+
+	return slot;
+}
+
+// next byte of transmitted frame (interrupts disabled)
+static u8 tx_next()
+{
+	const u8 *src = state.tx_src;
+	u8 n;
+
+	// data byte of the current block
+	if (state.tx_left) {
+		state.tx_left--;
+		return src[state.tx_byte++];
+	}
+
+	// zero after the block is implied by its code
+	if (state.flags & TX_ZERO) {
+		state.flags &= ~TX_ZERO;
+		state.tx_byte++;
+
+	// end of frame
+	} else if (state.tx_byte >= state.tx_size) {
+		state.flags |= TX_END;
+		return FRAME_DELIM;
+	}
+
+	// next block (up to the next zero)
+	for (n = 0; n < 0xFE; n++) {
+		if (state.tx_byte + n >= state.tx_size)
+			goto code;
+		if (src[state.tx_byte + n] == 0)
+			break;
+	}
+	if (n < 0xFE)
+		state.flags |= TX_ZERO;
+code:
+	state.tx_left = n;
+	return n + 1;
+}
+
+// begin transmitting oldest buffered frame (interrupts disabled), a
+// delimiter is sent first when the line was idle, so the receiver drops
+// whatever noise or partial frame it has before the frame starts
+static u8 tx_begin(u8 idle)
+{
+	u8 resend = state.resend & state.wait;
+	const frame_t *f = NULL;
+	const batch_t *b;
+
+	// retransmissions go ahead of the queue (a frame each)
+	if (state.again) {
+		u8 slot = oldest(state.again, state.rx_seq + 1);
+		state.again &= ~(1 << slot);
+		f = &replies[slot];
+	} else if (resend) {
+		u8 slot = oldest(resend, state.tx_seq);
+		state.resend &= ~(1 << slot);
+		f = &sent[slot];
+	}
+
+	if (f != NULL) {
+		state.flags  |= TX_COPY;
+		state.tx_src  = (u8 *)f + FRAME_START;
+		state.tx_size = frame_size(state.tx_src[0]);
+
+	// any frames left?
+	} else if ((b = ring_peek_as(batch_t, &tx_buf)) != NULL) {
+		state.flags  &= ~TX_COPY;
+		state.tx_src  = b->data;
+		state.tx_size = b->size;
 
-	// begin new operation (no need to involve buffer)
 	} else {
-		// copy data to transmit buffer
-		copy(&state.tx.s.packet, packet, sizeof(*packet), flags);
+		state.flags &= ~TX_PROGRESS;
+		// the last byte still shifts out for 22us, power-down would
+		// cut it short but the receiver is enabled whenever linked
+		power_hold(POWER_TX, 1);
+		return 0;
+	}
+
+	// set transmit state
+	state.flags  |= TX_PROGRESS;
+	state.flags  &= ~(TX_ZERO | TX_END);
+	power_hold(POWER_TX, 0);
+	state.tx_byte = 0;
+	state.tx_left = 0;
 
-		// set transmit state
-		state.flags  |= TX_PROGRESS;
-		state.tx_byte = 0;
+	// begin transmission
+	UDR = idle ? FRAME_DELIM : tx_next();
+	UCSRB |= _BV(UDRIE0); // enable ISR
 
-		// begin transmission
-		UDR = state.tx.data[state.tx_byte++];
-		UCSRB |= _BV(UDRIE0); // enable ISR
+	return 1;
+}
+
+// free transmitted frame and dispatch its event (interrupts disabled)
+static void tx_done()
+{
+	// retransmissions were reported the first time
+	if (state.flags & TX_COPY)
+		return;
+
+	const batch_t *b = ring_peek_as(batch_t, &tx_buf);
+	sev_t ev = {
+		.flags = TX | OK,
+		.sent  = { FRAME_TYPE(b->data[0]), FRAME_MODE(b->data[0]), b->count },
+	};
+
+	// slot goes back to serial_tx()
+	ring_release(&tx_buf);
+	dispatch(SERIAL, ev);
+}
+
+// queue frame being filled with its CRC (main loop)
+static void batch_close()
+{
+	u16 crc = crc16(CRC16_INIT, batch->data, batch->size);
+
+	batch->data[batch->size++] = crc >> 8;
+	batch->data[batch->size++] = crc;
+	batch = NULL;
+
+	save_int();
+
+	ring_commit(&tx_buf);
+
+	// begin new operation
+	if (!(state.flags & TX_PROGRESS))
+		(void) tx_begin(1);
+
+	rest_int();
+}
+
+// keep request or response in a frame of its own for retransmission
+static void batch_keep(const packet_t *h, const u8 *wire, u8 size)
+{
+	u8 slot = slot_of(h->seq);
+	frame_t *f = h->mode == REQUEST ? &sent[slot] : &replies[slot];
+	u8 *dst = (u8 *)f + FRAME_START;
+	u16 crc = crc16(CRC16_INIT, wire, size);
+
+	save_int();
+
+	f->packet.type = h->type;
+	f->packet.mode = h->mode;
+	memcpy(dst, wire, size);
+	dst[size]     = crc >> 8;
+	dst[size + 1] = crc;
+
+	if (h->mode == REQUEST) {
+		state.wait |= 1 << slot;
+		state.tx_seq++;
+	} else {
+		state.replied |= 1 << slot;
 	}
 
-	ret = 0; // success
-end:
 	rest_int();
+}
+
+// wire bytes of a packet (header, sequence number and body)
+static void packet_wire(u8 *wire, const packet_t *h, u8 header,
+	const packet_t *packet, u8 size, u8 flags)
+{
+	u8 n = 0;
+
+	wire[n++] = header;
+	if (FRAME_SEQ(h->mode))
+		wire[n++] = h->seq;
+	(void) copy(wire + n, &packet->content, size - n, flags);
+}
+
+// queue frame being filled (deferred call)
+static void batch_flush(u8 unused arg)
+{
+	if (batch != NULL)
+		batch_close();
+}
+
+u8 serial_tx(packet_t *packet, u8 flags)
+{
+	packet_t h;
+
+	// type, mode, header and sequence number first (they set the size)
+	(void) copy(&h, packet, offsetof(packet_t, content), flags);
+
+	// unused header of requests and messages isn't sent
+	u8 status = h.mode == RESPONSE ? h.header.response.status : 0;
+	u8 header = FRAME_HEADER(h.type, h.mode, status);
+	u8 size = frame_size(FRAME_HEADER(h.type, h.mode, 0));
+	if (size == 0)
+		return 1; // unknown type
+	size -= 2; // the CRC is per frame
+
+	// requests are numbered in order (window slot has to be free)
+	if (h.mode == REQUEST) {
+		if (state.wait & (1 << slot_of(state.tx_seq)))
+			return 1; // window full
+		h.seq = state.tx_seq;
+	}
+
+	// main loop is the only producer, so the frame is filled in with
+	// interrupts enabled and queued once the running event is handled
+	// (or when full, an idle receiver has a slot for each packet)
+	if (batch != NULL && (batch->size + size + 2 > SERIAL_BATCH ||
+	    batch->count == 1 << SERIAL_BUFSIZE))
+		batch_close();
+	if (batch == NULL) {
+		batch = ring_reserve_as(batch_t, &tx_buf);
+		if (batch == NULL) {
+			if (h.mode != RESPONSE)
+				return 1; // fail
+
+			// a response goes out as a retransmission instead, its
+			// request is answered either way (a repeated request
+			// would be acted on twice otherwise)
+			u8 wire[sizeof(frame_t) - FRAME_START];
+			packet_wire(wire, &h, header, packet, size, flags);
+			batch_keep(&h, wire, size);
+
+			save_int();
+			state.again |= 1 << slot_of(h.seq);
+			if (!(state.flags & TX_PROGRESS))
+				(void) tx_begin(1);
+			rest_int();
+
+			return 0;
+		}
+		batch->size  = 0;
+		batch->count = 0;
+
+		// runs ahead of the next event, or the
+		// SERIAL_FLUSH hook does it if it's full
+		(void) defer(batch_flush, 0);
+	}
+
+	// previous packet of the frame isn't the last
+	if (batch->count)
+		batch->data[batch_last] |= FRAME_MORE;
+	batch_last = batch->size;
+
+	u8 *wire = &batch->data[batch->size];
+	packet_wire(wire, &h, header, packet, size, flags);
+
+	batch->size += size;
+	batch->count++;
+
+	// keep a copy for retransmission
+	if (h.mode != MESSAGE)
+		batch_keep(&h, wire, size);
+
+	return 0; // success
+}
 
-	return ret;
+u8 e_serial_flush(u8 unused id, u8 unused code, ptr unused arg)
+{
+	// packets of the hooks (or left by a full defer buffer)
+	batch_flush(0);
+
+	return EVENT_NEXT;
+}
+
+u8 serial_waiting()
+{
+	return state.wait;
 }
 
-void serial_tx_next()
+u8 serial_retry()
 {
 	save_int();
 
-	// blocking on transmitted packet
-	if (state.flags & TX_BLOCKING) {
-		// dispatch event (prepared in ISR)
-		dispatch(SERIAL, (ptr)&state.tx_ev);
+	// only the unanswered ones
+	u8 wait = state.resend = state.wait;
+	if (wait && !(state.flags & TX_PROGRESS))
+		(void) tx_begin(1);
 
-		// clear blocking flag
-		state.flags &= ~TX_BLOCKING;
+	rest_int();
 
-		// any packets left?
-		if (ring_pop(&tx_buf, &state.tx.s.packet) == NULL) {
-			state.flags &= ~TX_PROGRESS;
-			goto end;
-		}
+	return wait;
+}
 
-		// set transmit state
-		state.tx_byte = 0;
+void serial_abort()
+{
+	save_int();
 
-		// begin transmission
-		UDR = state.tx.data[state.tx_byte++];
-		UCSRB |= _BV(UDRIE0); // enable ISR
+	state.wait = 0;
+	state.resend = 0;
 
-	} else { 
-		// set dispatch flag
-		state.flags |= TX_DISPATCH;
-	}
-end:
 	rest_int();
 }
 
 void serial_rx_next()
 {
-	save_int();
+	// oldest received packet is done (slots are handled in order)
+	ring_release(&rx_buf);
+}
 
-	// buffered packets
-	if (ring_pop(&rx_buf, &state.rx_ev.target) != NULL) {
-		// dispatch immediately
-		state.rx_ev.flags = RX | OK;
-		dispatch(SERIAL, (ptr)&state.rx_ev);
+void serial_set(u8 disable)
+{
+	save_int();
 
-	// no packets in buffer
+	if (disable) {
+		// disable receiver
+		UCSRB &= ~(_BV(RXCIE0) | _BV(RXEN0));
 	} else {
-		state.flags |= RX_DISPATCH;
+		// enable receiver (from the next delimiter)
+		state.flags |= RX_SKIP;
+		UCSRB |= _BV(RXCIE0) | _BV(RXEN0);
 	}
+	power_hold(POWER_RX, disable);
 
 	rest_int();
 }
 
+// CRC of a received request as if it was sent in a frame of its own
+// (interrupts disabled)
+static u16 rx_key(const packet_t *p)
+{
+	u8 header = FRAME_HEADER(p->type, p->mode, 0);
 
-// RX complete interrupt (receive byte)
-ISR(USART_RX_vect)
+	return crc16(crc16_step(CRC16_INIT, header), &p->seq,
+		frame_size(header) - 3);
+}
+
+// match received packet with the request window (interrupts disabled),
+// nonzero if it's not passed on
+static u8 rx_window(const packet_t *p)
 {
-	// current packet has unreceived bytes
-	if (likely(state.rx_byte < sizeof(state.rx.s))) {
-		// append received byte
-		state.rx.data[state.rx_byte++] = UDR;	
-
-		// preamble mismatch
-		if (unlikely(
-			(state.rx_byte == sizeof(state.rx.s.pre))
-			&& (state.rx.s.pre != PREAMBLE))
-		)
-			// discard first byte
-			(void) memmove((ptr)state.rx.data,
-				(ptr)&state.rx.data[1], --state.rx_byte);
-	}
+	u8 slot = slot_of(p->seq), bit = 1 << slot;
+	u16 key;
+
+	switch (p->mode) {
+	// answered already, the reply got lost (or took too long)
+	case REQUEST:
+		key = rx_key(p);
+		if ((state.replied & bit) && replies[slot].packet.seq == p->seq &&
+		    asked[slot] == key) {
+			state.again |= bit;
+			if (!(state.flags & TX_PROGRESS))
+				(void) tx_begin(1);
+			break;
+		}
 
-	// current packet is done
-	if (unlikely(state.rx_byte >= sizeof(state.rx.s))) {
-		// postamble mismatch
-		if (unlikely(state.rx.s.post != POSTAMBLE)) {
-			// dispatch error
-			state.rx_ev.flags = RX | FAIL | FRAM;
-			dispatch(SERIAL, (ptr)&state.rx_ev);
-		} else {
-			// put packet in buffer
-			if (ring_put(&rx_buf, &state.rx.s.packet, 0) == NULL) {
-				// buffer is full
-				state.rx_ev.flags = RX | FAIL | FULL;
-				dispatch(SERIAL, (ptr)&state.rx_ev);
-				goto prep;
-			}
-
-			// dispatch next packet if possible
-			if (state.flags & RX_DISPATCH) {
-				// dispatch event
-				(void) ring_pop(&rx_buf, &state.rx_ev.target);
-				state.rx_ev.flags = RX | OK;
-				dispatch(SERIAL, (ptr)&state.rx_ev);
-
-				// clear can dispatch flag
-				state.flags &= ~RX_DISPATCH;
-			}
+		// new request (takes the slot)
+		state.replied &= ~bit;
+		state.again &= ~bit;
+		asked[slot] = key;
+
+		// (a resent request can come in after later ones)
+		if ((s8)(p->seq - state.rx_seq) > 0)
+			state.rx_seq = p->seq;
+		return 0;
+
+	// request is answered (unless it was already)
+	case RESPONSE:
+		if ((state.wait & bit) && sent[slot].packet.seq == p->seq) {
+			state.wait &= ~bit;
+			state.resend &= ~bit;
+			return 0;
 		}
-prep:
-		// prepare to receive next packet
-		state.rx_byte = 0;
+		break;
+
+	default:
+		return 0;
 	}
+
+	if (likely(g_serial_drops.dup < (u8)~0))
+		g_serial_drops.dup++;
+	return 1;
 }
 
-// USART data register empty
-ISR(USART_UDRE_vect)
+// report bad frame, only the first one of a burst, so that line
+// noise doesn't fill up the event buffer (interrupts disabled)
+static void rx_fail(u8 flags)
 {
-	// current packet has untransmitted bytes
-	if (likely(state.tx_byte < sizeof(state.tx.s)))
-		UDR = state.tx.data[state.tx_byte++]; // transmit next
-
-	// transmission complete
-	if (unlikely(state.tx_byte >= sizeof(state.tx.s))) {
-		// prepare event
-		(void) memcpy(&state.tx_ev.target, 
-			&state.tx.s.packet, sizeof(state.tx_ev.target));
-		state.tx_ev.flags = TX | OK;
-
-		// can't continue if last dispatch hasn't been handled
-		if (!(state.flags & TX_DISPATCH)) {
-			state.flags |= TX_BLOCKING;
-			goto done;
+	if (state.flags & RX_NOISE)
+		return;
+
+	state.flags |= RX_NOISE;
+	dispatch(SERIAL, ((sev_t){ .flags = RX | FAIL | flags }));
+}
+
+// publish packets of a good frame that pass the window, in order and a
+// slot each (released by serial_rx_next()), packets after a dropped one
+// move up a slot (interrupts disabled)
+static void rx_publish()
+{
+	u8 kept = 0;
+
+	for (u8 i = 0; i < state.rx_count; i++) {
+		frame_t *f = ring_reserve_nth_as(frame_t, &rx_buf, i - kept);
+		frame_t *dst = ring_reserve_as(frame_t, &rx_buf);
+
+		// no room for the event, the rest are lost before the window
+		// takes them (so a response is waited for and sent again)
+		if (unlikely(!ev_room(SERIAL))) {
+			if (likely(g_serial_drops.full < (u8)~0))
+				g_serial_drops.full++;
+			rx_fail(FULL);
+			return;
 		}
 
-		// dispatch for sent packet
-		dispatch(SERIAL, (ptr)&state.tx_ev);
-		
-		// clear dispatch flag
-		state.flags &= ~TX_DISPATCH;
+		if (rx_window(&f->packet))
+			continue;
+
+		if (f != dst)
+			memcpy(dst, f, sizeof(frame_t));
 
-		// no queued packets
-		if (ring_pop(&tx_buf, &state.tx.s.packet) == NULL) {
-			state.flags &= ~TX_PROGRESS;
-			goto done;
+		// buffered (there was room with interrupts disabled) unless
+		// nothing handles it, then there is no event to release the slot
+		if (dispatch(SERIAL, ((sev_t){ .flags = RX | OK,
+		    .target = &dst->packet })) == EVENT_BUFFERED) {
+			ring_commit(&rx_buf);
+			kept++;
 		}
+	}
+}
+
+// end of received frame (interrupts disabled)
+static void rx_end()
+{
+	// bad frame (counted when it was found)
+	if (state.flags & RX_SKIP) {
+		state.flags &= ~RX_SKIP;
+
+	// consecutive delimiters
+	} else if (state.rx_code == 0) {
+		return;
+
+	// packets don't add up to the frame (or garbage between frames)
+	} else if (unlikely(state.rx_tail != 2)) {
+		if (likely(g_serial_drops.size < (u8)~0))
+			g_serial_drops.size++;
+		rx_fail(FRAM);
+
+	// corrupted
+	} else if (unlikely(state.rx_crc != 0)) {
+		if (likely(g_serial_drops.crc < (u8)~0))
+			g_serial_drops.crc++;
+		rx_fail(CRC);
+
+	} else {
+		state.flags &= ~RX_NOISE;
+
+		// buffer was full (the packets that fit are passed on)
+		if (unlikely(state.flags & RX_FULL)) {
+			if (likely(g_serial_drops.full < (u8)~0))
+				g_serial_drops.full++;
+			rx_fail(FULL);
+		}
+
+		rx_publish();
+	}
+
+	// prepare to receive next frame
+	state.flags &= ~RX_FULL;
+	state.rx_byte = 0;
+	state.rx_head = FRAME_MORE;
+	state.rx_size = 0;
+	state.rx_count = 0;
+	state.rx_tail = 0;
+	state.rx_left = 0;
+	state.rx_code = 0;
+	state.rx_crc = CRC16_INIT;
+}
 
-		// set transmit state
-		state.tx_byte = 0;
+// next packet of the frame goes into the next free slot (or nowhere)
+static inline void rx_next()
+{
+	frame_t *f = NULL;
+
+	if (likely(!(state.flags & RX_FULL)))
+		f = ring_reserve_nth_as(frame_t, &rx_buf, state.rx_count);
+
+	if (likely(f != NULL)) {
+		state.rx_count++;
+	} else {
+		state.flags |= RX_FULL;
+		f = &state.rx;
+	}
+
+	state.rx_dst = f;
+	state.rx_byte = 0;
+}
+
+// append decoded byte (nonzero if the frame is malformed)
+static inline u8 rx_store(u8 byte)
+{
+	state.rx_crc = crc16_step(state.rx_crc, byte);
+
+	// end of packet, CRC follows unless another packet does
+	if (state.rx_byte == state.rx_size) {
+		if (!(state.rx_head & FRAME_MORE))
+			return ++state.rx_tail > 2;
+		rx_next();
+	}
+
+	// header tells the size of the packet and where it goes,
+	// it's unpacked in front of the body
+	if (state.rx_byte == 0) {
+		packet_t *p = &state.rx_dst->packet;
+		u8 size = frame_size(byte & ~FRAME_MORE);
+
+		if (unlikely(size == 0))
+			return 1;
+
+		p->type = FRAME_TYPE(byte);
+		p->mode = FRAME_MODE(byte);
+		p->header.response.status = FRAME_STATUS(byte);
+		state.rx_head  = byte;
+		state.rx_size  = size - 2;
+		state.rx_start = frame_start(p->mode);
+		state.rx_byte  = 1;
+		return 0;
+	}
+
+	((u8 *)state.rx_dst)[state.rx_start + state.rx_byte++] = byte;
+
+	return 0;
+}
+
+/* Every received byte takes a bounded amount of work, a data byte is stored
+ * and added to the CRC, a header also reserves a slot, a COBS code stores a
+ * zero and a delimiter checks the frame and publishes its packets (or reports
+ * the first bad frame of a burst). There is no searching, resyncing after
+ * noise is waiting for the next delimiter with the bytes up to it ignored.
+ */
+
+// received byte (interrupts disabled)
+static inline void rx_recv(u8 byte, u8 error)
+{
+	// resync on every delimiter
+	if (byte == FRAME_DELIM) {
+		rx_end();
+		return;
+	}
+
+	if (unlikely(state.flags & RX_SKIP))
+		return;
+
+	// damaged byte or lost bytes
+	if (unlikely(error))
+		goto drop;
 
-		// begin transmission
-		UDR = state.tx.data[state.tx_byte++];
+	// data byte of the current COBS block
+	if (likely(state.rx_left)) {
+		state.rx_left--;
+		if (rx_store(byte))
+			goto drop;
+		return;
 	}
 
-	// can transmit more
+	// zero implied by the previous block (unless it was
+	// the first one or full)
+	if (state.rx_code != 0 && state.rx_code < 0xFF) {
+		if (rx_store(0))
+			goto drop;
+	}
+
+	// COBS code
+	state.rx_code = byte;
+	state.rx_left = byte - 1;
 	return;
 
+drop:
+	if (likely(g_serial_drops.size < (u8)~0))
+		g_serial_drops.size++;
+	rx_fail((error & _BV(DOR0)) ? ORUN : FRAM);
+	state.flags |= RX_SKIP;
+}
+
+// RX complete interrupt (receive byte)
+ISR(USART_RX_vect)
+{
+#ifdef INT_STATS
+	u16 start = TCNT1;
+#endif
+	// error flags are for the byte in UDR
+	u8 error = UCSRA & (_BV(FE0) | _BV(DOR0));
+
+	power_woke(WAKE_RX);
+	rx_recv(UDR, error);
+
+#ifdef INT_STATS
+	u16 d = TCNT1 - start;
+	if (d > g_serial_rx)
+		g_serial_rx = d;
+#endif
+}
+
+// USART data register empty
+ISR(USART_UDRE_vect)
+{
+	power_woke(WAKE_UDRE);
+
+	// current frame has untransmitted bytes
+	if (likely(!(state.flags & TX_END))) {
+		UDR = tx_next(); // transmit next
+		return;
+	}
+
+	// transmission complete (last byte is in the USART, UDR can
+	// only take the next one now that it's empty again)
+	tx_done();
+
+	// continue with next
+	if (tx_begin(0))
+		return;
+
 	// nothing to transmit
-done:
 	UCSRB &= ~_BV(UDRIE0); // disable ISR
 }
 
@@ -277,11 +850,12 @@ INIT()
 	// enable double speed (250kbs -> 500kbs)
 	UCSRA = _BV(U2X0);
 
-	// enable interrupts + RX/TX
-	UCSRB = _BV(RXCIE0) | _BV(RXEN0) | _BV(TXEN0);
+	// enable TX (receiver is enabled with serial_set())
+	UCSRB = _BV(TXEN0);
 
-	// asynchronous receiver + even parity + 1 bit stop + 8 bit char
-	UCSRC = _BV(UPM01) | _BV(UCSZ01) | _BV(UCSZ00);
+	// asynchronous receiver + no parity (frames have a CRC)
+	// + 1 bit stop + 8 bit char
+	UCSRC = _BV(UCSZ01) | _BV(UCSZ00);
 }
 
 #pragma GCC diagnostic pop
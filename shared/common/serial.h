@@ -4,13 +4,30 @@
 #include "util/type.h"
 #include "util/attr.h"
 #include "util/ring.h"
+#include "util/event.h"
 #include "common/state.h"
 
 // this packet system is trash, it should be redesigned
 
-// how many packets to buffer
+// how many received packets to buffer
 #define SERIAL_BUFSIZE 3 // (1 << 3) = 8
 
+// how many frames to buffer for transmission (the responses to a full
+// request window are a frame each when they are handled one by one) and
+// how many wire bytes (packets and CRC) a frame can take
+#define SERIAL_FRAMES 2 // (1 << 2) = 4
+#define SERIAL_BATCH  32
+
+/* RAM taken by the link on each board, a frame_t being 10 bytes (16 with
+ * EVENT_PROFILE): tx_buf 4 x 34, rx_buf 8 x frame_t, sent and replies 4 x
+ * frame_t each, asked 4 x 2 and the state with a spare frame_t. That is
+ * about 340 bytes (440), 17% (21%) of the 2KB of the ATmega328P.
+ */
+
+// how many requests can wait for a response (both ends keep a copy of each
+// request in flight and of the responses to as many of the latest requests)
+#define SERIAL_WINDOW 2 // (1 << 2) = 4
+
 // packet sent between frontend and backend
 typedef struct {
 	// packet type enumeration
@@ -18,7 +35,17 @@ typedef struct {
 		SYNC,    // synchronize state
 		CHANGE,  // state change
 		CHKCODE, // unlock with code
-		NEWCODE  // change unlock code
+		NEWCODE, // change unlock code
+		// (optional ones keep their numbers for trace.py)
+#ifdef EVENT_TRACE
+		TRACE   = 4, // flight recorder dump (request) or entry (message)
+#endif
+#ifdef EVENT_PROFILE
+		PROFILE = 5, // handler profile entry
+#endif
+#ifdef SLEEP_STATS
+		POWER   = 6, // power counters dump (request) or counter (message)
+#endif
 	} packed type;
 
 	// message mode
@@ -31,7 +58,8 @@ typedef struct {
 		} packed request;
 
 		struct {
-			enum { OK, FAIL } packed status;
+			// (OK and FAIL are sev_t flags)
+			enum { RESP_OK, RESP_FAIL } packed status;
 		} packed response;
 
 		struct {
@@ -39,6 +67,10 @@ typedef struct {
 		} packed message;
 	} packed header;
 
+	// sequence number (set by serial_tx() for requests, responses have to
+	// copy it from their request, messages have none)
+	u8 seq;
+
 	// packet body
 	union {
 		struct {
@@ -58,23 +90,84 @@ typedef struct {
 			u16 old_code;
 			u16 new_code;
 		} packed newcode;
+
+#ifdef EVENT_TRACE
+		struct {
+			u8 index; // entry (0 is oldest)
+			u8 shift; // cycles = time << shift
+			event_trace_t entry;
+		} packed trace;
+#endif
+
+#ifdef SLEEP_STATS
+		struct {
+			u8 index; // counter (u32 index into power_stats_t)
+			u8 count; // counters (same size as a TRACE entry)
+			u8 shift; // cycles = counts << shift
+			u32 value;
+		} packed power;
+#endif
+
+#ifdef EVENT_PROFILE
+		struct {
+			u8 id;    // handler id
+			u8 shift; // cycles = counts << shift
+			event_prof_t prof;
+		} packed profile;
+#endif
 	} content;
 } packed packet_t;
 
-// actual data that's send, including a packet + framing bytes
-typedef union {
-	// structure of data
-	struct {
-#define PREAMBLE  (u32)(0b11001100110010101010110100110110)
-#define POSTAMBLE (u32)(0b01100011001101010101001100110011)
-		u32 pre; // packet frame preamble
-		packet_t packet; // packet data
-		u32 post; // packet frame postamble
-	} packed s;
-
-	// access to data (GNU extension and will cause warnings)
-	u8 data[0];
-} realpacket_t;
+/* A frame on the wire is one or more packets and a CRC-16 (util/crc.h) of
+ * them, COBS encoded so that it has no zero bytes and followed by a zero byte.
+ * A packet is a header byte, the sequence number (requests and responses) and
+ * the body. The header packs type, mode, response status and whether another
+ * packet follows in the frame, the body length is set by type and mode (a
+ * SYNC request has none), content past it is undefined in received packets.
+ * Packets queued by the handlers of one event go out in as few frames as they
+ * fit in (no more packets than an idle receiver has slots for), the receiver
+ * passes them on one event each. A receiver syncs on the next zero after
+ * noise, frames with a bad CRC or size are counted and dropped with all of
+ * their packets (only the first of a burst is reported as a FAIL event), of a
+ * frame that finds the buffer full the packets that fit are passed on. The
+ * overhead is 4 bytes a frame (COBS code, CRC and delimiter) plus a leading
+ * zero when transmission starts on an idle line.
+ */
+#define FRAME_DELIM 0x00
+
+// frame header byte
+#define FRAME_HEADER(type, mode, status) \
+	((type) | ((mode) << 4) | (((status) & 1) << 6))
+#define FRAME_TYPE(h)   ((h) & 0x0F)
+#define FRAME_MODE(h)   (((h) >> 4) & 0x03)
+#define FRAME_STATUS(h) (((h) >> 6) & 0x01)
+#define FRAME_MORE      (1 << 7) // another packet follows
+
+// frame has a sequence number (by mode)
+#define FRAME_SEQ(mode) ((mode) != MESSAGE)
+
+// packet in a ring slot, the wire bytes (header, sequence number, body and
+// CRC of a frame of its own) end up in front of the content of the packet,
+// type and mode are unpacked in front of them
+typedef struct {
+	packet_t packet;
+	u8 crc[2]; // room for the CRC after the largest body
+} packed frame_t;
+
+// dropped frames (saturate)
+typedef struct {
+	u8 crc;  // CRC mismatch
+	u8 size; // wrong size, or a USART framing/overrun error in it
+	u8 full; // receive (or event) buffer full
+	u8 dup;  // repeated request (answered again) or unexpected response
+} packed serial_drops_t;
+
+extern serial_drops_t g_serial_drops;
+
+#ifdef INT_STATS
+// longest run of the RX ISR (TIMER1 counts)
+extern u16 g_serial_rx;
+#endif
 
 // serial event data
 typedef struct {
@@ -83,20 +176,53 @@ typedef struct {
 #define OK   (1 << 2) // operation successful
 #define FAIL (1 << 3) // operation failed
 #define FULL (1 << 4) // buffer is full
-#define PRTY (1 << 5) // parity error
-#define ORUN (1 << 6) // buffer overrun
-#define FRAM (1 << 7) // framing error
+#define CRC  (1 << 5) // CRC mismatch
+#define ORUN (1 << 6) // USART overrun
+#define FRAM (1 << 7) // framing error (frame size or USART)
 	u8 flags;
-	packet_t target; // not zeroed on error to save time
-} sev_t;
+	union {
+		// RX: received packet (in place), valid until serial_rx_next()
+		packet_t *target;
 
-// asynchronously transmit packet
+		// TX: header of the first packet of transmitted frame
+		struct {
+			u8 type;
+			u8 mode;
+			u8 count; // packets in the frame
+		} packed sent;
+	}; // unset on error
+} packed sev_t;
+
+// asynchronously transmit packet (only the body of its type and mode is
+// read), it goes out with the others queued by the handlers of the same
+// event (or idle hooks), nonzero if the buffer or the request window is
+// full or the type is unknown
 u8 serial_tx(packet_t *packet, u8 flags);
 
-// allow next transmitted packet to generate event
-void serial_tx_next();
+/* Requests don't hold up the packets queued after them, up to the window
+ * of them wait for their responses at a time. A response is only passed on
+ * if its request is waiting and a request that was answered already is
+ * answered again with the same response (it got lost), so the receiver acts
+ * on each request once. The requester is in charge of timeouts, it resends
+ * the requests still waiting with serial_retry() and gives up on them with
+ * serial_abort(). Sequence numbers start over on reset, so the first new
+ * requests of a requester that was reset may be answered from the old ones
+ * (if they are identical).
+ */
+
+// requests waiting for a response (nonzero if any)
+u8 serial_waiting();
+
+// transmit requests still waiting for a response again (nonzero if any)
+u8 serial_retry();
 
-// allow next received packet to generate event
+// stop waiting for responses (link lost)
+void serial_abort();
+
+// done with received packet (RX events are released in order)
 void serial_rx_next();
 
+// disable receiver (disabled at start)
+void serial_set(u8 disable);
+
 #endif // !SERIAL_H
@@ -5,8 +5,12 @@
 
 #include <avr/io.h>
 
-u8 e_tick_show(u8 unused id, u8 unused code, ptr unused arg)
+u8 e_tick_show(u8 unused id, u8 unused code, u8 *arg)
 {
+	// LED keeps its phase if ticks were coalesced
+	if (!(*arg & 1))
+		return 0;
+
 #if PLATFORM == MEGA
 	PIND |= _BV(0);
 #elif PLATFORM == UNO
@@ -4,6 +4,7 @@
 #include "util/interrupt.h"
 #include "common/defs.h"
 #include "common/timer.h"
+#include "common/power.h"
 
 /* for TIMER1 we don't need plaform specific #if defined()'s
  * as the registers and presaclers are identical for TIMER1
@@ -22,12 +23,48 @@ static const struct {
 	{   1, 1}
 };
 
+/* timer counts between compare matches (one tick) */
+static u16 step;
+
+/* log2 of prescaler (cycles per count) */
+static u8 shift;
+
+#ifdef TIMER_TICKLESS
+/* in tickless mode the compare match is moved to the next deadline of the
+ * timer wheel, so one match may stand for several ticks (or there may be
+ * no match at all when nothing is armed)
+ */
+static u16 last; // counter at the last accounted tick
+static u8 span;  // ticks up to the current compare match
+static u8 idle;  // compare match is off (nothing armed)
+static u8 maxspan; // longest span the 16-bit counter can hold
+#endif
+
+/* TIMER events are coalesced, the ISR only counts ticks while
+ * an event is buffered and the loop gets all of them at once
+ */
+static volatile u8 behind; // ticks the timer wheel hasn't seen yet
+static volatile u8 queued; // TIMER event is buffered
+
+/* software timer wheel, each slot is a list of the timers expiring on
+ * the tick the wheel reaches it (after their remaining revolutions)
+ */
+static struct {
+	stimer_t *slot[STIMER_SLOTS];
+	stimer_t *expired; // detached slot being processed
+	u8 now; // current slot
+} wheel;
+
 /* stop timer */
 void timer_stop()
 {
 	save_int();
 
 	TIMSK1 &= ~_BV(OCIE1A); // disable timer
+	power_hold(POWER_TIMER, 1);
+#ifdef TIMER_TICKLESS
+	idle = 0; // stays off
+#endif
 
 	rest_int();
 }
@@ -37,7 +74,15 @@ void timer_start()
 {
 	save_int();
 
-	TIMSK1 |= _BV(OCIE1A); // enable timer
+	OCR1A   = TCNT1 + step;  // first tick from now
+	TIFR1   = _BV(OCF1A);    // clear stale match
+	TIMSK1 |= _BV(OCIE1A);   // enable timer
+	power_hold(POWER_TIMER, 0);
+#ifdef TIMER_TICKLESS
+	last = OCR1A - step;
+	span = 1;
+	idle = 0;
+#endif
 
 	rest_int();
 }
@@ -56,6 +101,15 @@ void timer_setup(u16 freq)
 	while (i < length(ps))
 	{
 		now = rom(ps[i].fact, word); // temp
+#ifdef TIMER_TICKLESS
+		// largest prescaler that divides evenly, a span of ticks
+		// has to be a whole number of counts and long spans sleep more
+		if (F_CPU % ((u32)freq*now) == 0) {
+			old = F_CPU/((u32)freq*now) - 1;
+			i++;
+			break;
+		}
+#endif
 		now = F_CPU/((u32)freq*now) - 1;
 		if (now > (u16)~0)
 			break;
@@ -67,19 +121,273 @@ void timer_setup(u16 freq)
 	// configure timer
 	TCCR1B &= ~7;
 	TCCR1B |= rom(ps[i].bits, byte);
-	OCR1A   = old;
+	step    = old + 1;
+	shift   = __builtin_ctz(rom(ps[i].fact, word));
+	OCR1A   = TCNT1 + step;
+#ifdef TIMER_TICKLESS
+	last    = OCR1A - step;
+	span    = 1;
+	maxspan = ((u16)~0 / step > (u8)~0) ? (u8)~0 : (u16)~0 / step;
+#endif
+
+	rest_int();
+}
+
+/* free running timestamp (timer counts, wraps around) */
+u16 timer_now()
+{
+	u16 now;
+
+	save_int();
+
+	now = TCNT1; // 16-bit read isn't atomic
 
 	rest_int();
+
+	return now;
+}
+
+/* timestamp unit (cycles = counts << shift) */
+u8 timer_shift()
+{
+	return shift;
+}
+
+/* link timer into wheel slot (interrupts disabled) */
+static void stimer_link(stimer_t *t, stimer_t **head)
+{
+	t->next  = *head;
+	t->pprev = head;
+	if (*head != NULL)
+		(*head)->pprev = &t->next;
+	*head = t;
+}
+
+/* unlink timer from whichever list it's in (interrupts disabled) */
+static void stimer_unlink(stimer_t *t)
+{
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+}
+
+/* link timer d ticks (at least 1) ahead of the wheel (interrupts disabled) */
+static void stimer_place(stimer_t *t, u16 d)
+{
+	t->rounds = (d - 1) >> STIMER_BITS;
+	stimer_link(t, &wheel.slot[(wheel.now + d) & (STIMER_SLOTS - 1)]);
+}
+
+#ifdef TIMER_TICKLESS
+/* ticks until the earliest deadline in the wheel, 0 if nothing is armed */
+static u16 stimer_next()
+{
+	stimer_t *t;
+	u16 d, min = 0;
+
+	for (u8 i = 1; i <= STIMER_SLOTS; i++)
+	{
+		// later slots can't beat this
+		if ((min > 0) && (min <= i))
+			break;
+
+		t = wheel.slot[(wheel.now + i) & (STIMER_SLOTS - 1)];
+		for (; t != NULL; t = t->next)
+		{
+			d = i + (t->rounds << STIMER_BITS);
+			if ((min == 0) || (d < min))
+				min = d;
+		}
+	}
+
+	return min;
+}
+
+/* whole ticks since the last accounted tick (interrupts disabled) */
+static u8 timer_lag()
+{
+	return idle ? 0 : (u16)(TCNT1 - last) / step;
+}
+
+/* move the compare match to the next deadline (interrupts disabled), while
+ * the wheel is behind the ISR ticks along and the loop calls this again
+ */
+static void timer_program()
+{
+	u16 d;
+	u8 lag;
+
+	// stopped or the wheel is behind
+	if ((!idle && !(TIMSK1 & _BV(OCIE1A))) || (behind > 0)
+		|| (TIFR1 & _BV(OCF1A)))
+		return;
+
+	// nothing armed, sleep until some other interrupt
+	if ((d = stimer_next()) == 0) {
+		TIMSK1 &= ~_BV(OCIE1A);
+		power_hold(POWER_TIMER, 1);
+		idle = 1;
+		return;
+	}
+
+	// restart from the current count
+	if (idle) {
+		last    = TCNT1;
+		TIFR1   = _BV(OCF1A);
+		TIMSK1 |= _BV(OCIE1A);
+		power_hold(POWER_TIMER, 0);
+		idle    = 0;
+	}
+
+	// has to be ahead of the counter and fit into it
+	lag = timer_lag();
+	if (d > maxspan)
+		d = maxspan;
+	if (d <= lag)
+		d = lag + 1;
+
+	span  = d;
+	OCR1A = last + d*step;
+}
+#else
+#define timer_lag() 0
+#define timer_program()
+#endif
+
+/* (re)arm timer, expires after ticks (at least 1) and then every period */
+void stimer_arm(stimer_t *t, u8 ticks, u8 period)
+{
+	save_int();
+
+	// re-arming restarts the timer
+	if (t->pprev != NULL)
+		stimer_unlink(t);
+
+	// ticks that have passed but the wheel hasn't seen count too
+	t->period = period;
+	stimer_place(t, (u16)(ticks + !ticks) + behind + timer_lag());
+
+	// might be the new earliest deadline
+	timer_program();
+
+	rest_int();
+}
+
+/* cancel timer (no-op if it isn't armed), in tickless mode the compare
+ * match isn't moved so the wheel may wake up once for nothing
+ */
+void stimer_cancel(stimer_t *t)
+{
+	save_int();
+
+	if (t->pprev != NULL)
+		stimer_unlink(t);
+
+	rest_int();
+}
+
+/* advance the wheel by one tick, running expired timers */
+static void stimer_tick()
+{
+	stimer_t *t;
+
+	save_int();
+
+	// move to the next slot and detach its timers
+	wheel.now = (wheel.now + 1) & (STIMER_SLOTS - 1);
+	wheel.expired = wheel.slot[wheel.now];
+	wheel.slot[wheel.now] = NULL;
+	if (wheel.expired != NULL)
+		wheel.expired->pprev = &wheel.expired;
+	behind--;
+
+	// callbacks may arm or cancel any timer (including detached ones)
+	while ((t = wheel.expired) != NULL)
+	{
+		stimer_unlink(t);
+
+		// not this revolution
+		if (t->rounds > 0) {
+			t->rounds--;
+			stimer_link(t, &wheel.slot[wheel.now]);
+			continue;
+		}
+
+		// periodic timers are re-armed from their expiry (no drift)
+		if (t->period > 0)
+			stimer_place(t, t->period);
+
+		// run with interrupts enabled
+		ena_int();
+		t->func(t);
+		dis_int();
+	}
+
+	rest_int();
+}
+
+/* first TIMER handler, runs the timer wheel and latches the elapsed
+ * ticks for the other handlers
+ */
+u8 e_timer_tick(u8 unused id, u8 unused code, u8 *arg)
+{
+	save_int();
+
+	*arg   = behind;
+	queued = 0;
+
+	rest_int();
+
+	// wheel goes through every elapsed tick
+	for (u8 n = *arg; n > 0; n--)
+		stimer_tick();
+
+#ifdef TIMER_TICKLESS
+	// sleep until the next deadline (timed from here, the
+	// wheel ran with interrupts enabled)
+	dis_int();
+	timer_program();
+	rest_int();
+#endif
+
+	return 0;
 }
 
 /* we use the TIMER event to signal a timer interrupt */
 ISR(TIMER1_COMPA_vect)
 {
-	dispatch(TIMER);
+	power_woke(WAKE_TIMER);
+
+#ifdef TIMER_TICKLESS
+	u8 n = span;
+
+	// tick along until the loop programs the next deadline
+	last  = OCR1A;
+	span  = 1;
+	OCR1A = last + step;
+
+	// count ticks (saturates, handlers would be way behind anyway)
+	behind = (behind > (u8)~0 - n) ? (u8)~0 : behind + n;
+#else
+	// schedule next tick (counter isn't reset)
+	OCR1A += step;
+
+	// count tick (saturates, handlers would be way behind anyway)
+	if (likely(behind < (u8)~0))
+		behind++;
+#endif
+
+	// buffer TIMER event if there isn't one (retried on failure and while
+	// all of its handlers are disabled, cleared by e_timer_tick())
+	if (!queued)
+		queued = dispatch(TIMER, 0) == EVENT_BUFFERED;
 }
 
 /* timer initialization (started by main.c) */
 INIT()
 {
-	TCCR1B = _BV(WGM12); // CTC mode
+	// normal mode, the counter runs freely so it can be used for
+	// timestamps and ticks are scheduled with the compare match
+	TCCR1B = 0;
 }
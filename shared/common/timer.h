@@ -3,6 +3,31 @@
 
 #include "util/type.h"
 
+// timer wheel size (slots), timers further than this take revolutions
+#define STIMER_BITS 3
+#define STIMER_SLOTS (1 << STIMER_BITS)
+
+// software timer on the global tick, statically allocated by its user,
+// the callback is run from the event loop (TIMER event) on expiry
+typedef struct stimer {
+	struct stimer *next;   // next timer in wheel slot
+	struct stimer **pprev; // previous next pointer (NULL if not armed)
+	void (*func)(struct stimer *); // expiry callback
+	u8 rounds; // wheel revolutions left
+	u8 period; // ticks between expiries (0 = one-shot)
+} stimer_t;
+
+// initializer literal generator
+#define stimer_init(f) \
+	{	.next   = NULL, \
+		.pprev  = NULL, \
+		.func   = (f), \
+		.rounds = 0, \
+		.period = 0 }
+
+// is timer armed
+#define stimer_armed(t) ((t)->pprev != NULL)
+
 // stop timer
 void timer_stop();
 
@@ -12,4 +37,18 @@ void timer_start();
 // setup timer for frequency
 void timer_setup(u16 freq);
 
+// (re)arm timer, expires after ticks (at least 1) and then every period
+// ticks (0 = one-shot), safe to call from interrupts
+void stimer_arm(stimer_t *t, u8 ticks, u8 period);
+
+// cancel timer (no-op if it isn't armed)
+void stimer_cancel(stimer_t *t);
+
+// timestamp unit (cycles = counts << shift)
+u8 timer_shift();
+
+// free running timestamp (1 count = 4us with prescaler 64 at 10Hz,
+// 16us with prescaler 256 with TIMER_TICKLESS)
+u16 timer_now();
+
 #endif // !TIMER_H
@@ -0,0 +1,74 @@
+#include "globals.h"
+#include "util/init.h"
+#include "common/timer.h"
+#include "common/serial.h"
+#include "common/trace.h"
+
+#include <avr/io.h>
+#include <string.h>
+
+#ifdef EVENT_TRACE
+
+/* The flight recorder lives in .noinit, so after a (watchdog) reset it still
+ * holds the events that led up to it. A TRACE request on the serial link
+ * makes the board send it back as TRACE messages, trace.py in the repository
+ * root decodes them with the names from globals.in.
+ */
+
+#define TRACE_SIZE (1 << EVENT_TRACE_BITS)
+
+static void trace_send(stimer_t *t);
+
+static stimer_t timer = stimer_init(trace_send);
+static packet_t packet = { .type = TRACE, .mode = MESSAGE };
+
+// send as many entries as the serial buffer takes (every tick)
+static void trace_send(stimer_t *t)
+{
+	u8 *i = &packet.content.trace.index;
+
+	while (*i < TRACE_SIZE) {
+		// serial_tx() copies the packet
+		packet.content.trace.entry =
+			g_event_trace.log[(g_event_trace.head + *i) & (TRACE_SIZE - 1)];
+		if (serial_tx(&packet, 0))
+			return; // full, continue on next tick
+
+		(*i)++;
+	}
+
+	// done, continue recording
+	stimer_cancel(t);
+	g_event_trace.pause = 0;
+}
+
+void trace_dump()
+{
+	// already dumping
+	if (stimer_armed(&timer))
+		return;
+
+	// freeze recorder (head is the oldest entry)
+	g_event_trace.pause = 1;
+
+	packet.content.trace.index = 0;
+	packet.content.trace.shift = timer_shift();
+	stimer_arm(&timer, 1, 1);
+}
+
+INIT()
+{
+	// power-on reset (RAM is garbage)
+	if (g_event_trace.magic != EVENT_TRACE_MAGIC) {
+		(void) memset(&g_event_trace, TRACE_EMPTY, sizeof(g_event_trace));
+		g_event_trace.magic = EVENT_TRACE_MAGIC;
+		g_event_trace.head  = 0;
+	}
+	g_event_trace.pause = 0;
+
+	// mark reset with its cause
+	event_trace(&g_event_loop, TRACE_RESET, MCUSR, 0);
+	MCUSR = 0;
+}
+
+#endif // EVENT_TRACE
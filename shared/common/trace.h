@@ -0,0 +1,8 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// dump flight recorder over serial (TRACE messages, oldest entry first),
+// recording is paused until the dump is done
+void trace_dump();
+
+#endif // !TRACE_H
@@ -6,47 +6,99 @@
 #include <avr/pgmspace.h>
 
 // event/timer handler extern declarations (to make them visible here)
-#define _C_(code)
+#define _C_(code, prio, policy, type)
 #define _H_(id, handler, code, disable) \
 	extern u8 handler(u8, u8, ptr);
 #include "globals.in"
 #undef _C_
 #undef _H_
 
-// event handler ROM data (must be declared separately)
-#define _C_(code)
-#define _H_(id, handler, code, disable) \
-	static const _event_handler_t _##id##_rom PROGMEM = \
-		{&(handler), (code), (id)};
+// every event code needs a slot in _handler_layout_t
+_Static_assert(_N_CODES <= EVENT_MAXCODES, "too many event codes");
+
+// every handler needs a bit in the disable mask
+_Static_assert(_N_HANDLERS <= EVENT_MAXHANDLERS, "too many event handlers");
+
+// every payload needs to fit in an event
+_Static_assert(sizeof(_event_arg_t) <= EVENT_ARGSIZE, "event payload too big");
+
+// mask of handler ids below n
+#define _bits(n) ((n) > 0 ? (event_mask_t)~0 >> (EVENT_MAXHANDLERS - (n)) : 0)
+
+// handler id range, priority, overflow policy, payload size and id mask
+// of each event code
+static const _event_info_t g_event_loop_info[_N_CODES + 1] PROGMEM = {
+#define _C_(code, prio, policy, type) \
+	{_slot(code, ), (prio), (policy), sizeof(type), \
+		_bits(_slot((code) + 1, )) & ~_bits(_slot(code, ))},
+#define _H_(id, handler, code, disable)
 #include "globals.in"
 #undef _C_
 #undef _H_
+	{_N_HANDLERS, 0, 0, 0, 0} // end of last range
+};
 
-// event loop ring buffer
-static ring_t g_event_loop_buffer = ring_init(event_t, EVENT_BUFSIZE);
+// event handler ROM data (indexed by id)
+static const _event_handler_t g_event_loop_handlers[_N_HANDLERS] PROGMEM = {
+#define _C_(code, prio, policy, type)
+#define _H_(id, handler, code, disable) [id] = {&(handler), (code)},
+#include "globals.in"
+#undef _C_
+#undef _H_
+};
+
+// event loop ring buffers (separate due to flexible members)
+static ring_t g_event_loop_high   = ring_init(event_t, EVENT_BUFSIZE_HIGH);
+static ring_t g_event_loop_normal = ring_init(event_t, EVENT_BUFSIZE_NORMAL);
+static ring_t g_event_loop_low    = ring_init(event_t, EVENT_BUFSIZE_LOW);
+static ring_t g_event_loop_defer  = ring_init(event_defer_t, EVENT_BUFSIZE_DEFER);
+
+#ifdef EVENT_PROFILE
+// handler profiles (indexed by id)
+event_prof_t g_event_prof[_N_HANDLERS];
+#endif
+
+#ifdef EVENT_TRACE
+// flight recorder (validated by common/trace.c)
+event_recorder_t g_event_trace noinit;
+#endif
 
 // event loop RAM data
 event_loop_t g_event_loop = {
-	&g_event_loop_buffer,
-	// number of event handlers
-#define _C_(code)
-#define _H_(id, handler, code, disable) {},
-	sizeof((event_handler_t[]){
-#include "globals.in"
-	})/sizeof(((event_handler_t[]){
+	{&g_event_loop_high, &g_event_loop_normal, &g_event_loop_low},
+	&g_event_loop_defer,
+	g_event_loop_info,
+	g_event_loop_handlers,
+#ifdef EVENT_STATS
+	{},
+#endif
+	{}, // drops
+	{}, // peaks
+#ifdef EVENT_PROFILE
+	g_event_prof,
+#endif
+#ifdef EVENT_TRACE
+	&g_event_trace,
+#endif
+	EVENT_BUDGET,
+	0, // limit (set by event_run())
+	0, // start
+	0, // overruns
+	// initially disabled handlers
+	0
+#define _C_(code, prio, policy, type)
+#define _H_(id, handler, code, disable) \
+	| ((event_mask_t)!!(disable) << (id))
 #include "globals.in"
-	})[0]),
 #undef _C_
 #undef _H_
-	// event handlers
-	{
-#define _C_(code)
+	,
+	// event codes with initially enabled handlers
+	0
+#define _C_(code, prio, policy, type)
 #define _H_(id, handler, code, disable) \
-	{(_event_handler_t *)&_##id##_rom, (disable)},
-// event handler list (flexible struct member)
-// GCC allows flexible member init as an extension
+	| ((u8)!(disable) << (code))
 #include "globals.in"
-	}
 #undef _C_
 #undef _H_
 };
@@ -3,9 +3,22 @@
 
 #include "util/event.h"
 #include "common/defs.h"
+#include "common/state.h"
+#include "common/serial.h"
 
-// how many events are buffered, increase if unstable
-#define EVENT_BUFSIZE 5 // (1 << 5) = 32
+#include <string.h>
+
+// how many events are buffered per priority, size these by the high-water
+// marks and drop counters in g_event_loop (peak, drops)
+#define EVENT_BUFSIZE_HIGH   4 // (1 << 4) = 16
+#define EVENT_BUFSIZE_NORMAL 3 // (1 << 3) = 8
+#define EVENT_BUFSIZE_LOW    1 // (1 << 1) = 2 (TIMER is coalesced)
+#define EVENT_BUFSIZE_DEFER  2 // (1 << 2) = 4 deferred calls
+
+// how long a handler call may take (CPU cycles), bounds the dispatch latency
+// of high priority events to about this plus the interrupts, calls that go
+// over it are recorded in g_event_loop.overrun
+#define EVENT_BUDGET 8000 // 500us at 16MHz
 
 /* Due to severe memory limitations and architectural limitations on both
  * ATMega328 and ATMega2560, we don't have the luxury of implementing proper
@@ -17,31 +30,118 @@ extern event_loop_t g_event_loop; // global event loop
 
 // event codes
 typedef enum {
-#define _C_(code) code,
+#define _C_(code, prio, policy, type) code,
 #define _H_(id, handler, code, disable)
 #include "globals.in"
 #undef _C_
 #undef _H_
+	_N_CODES // number of event codes
 } _event_code_t;
 
-// event handler ids
+// how many event codes _handler_layout_t has slots for
+#define EVENT_MAXCODES 8
+
+/* Handlers are grouped by event code at compile time. The preprocessor can't
+ * compare tokens, so each code slot makes its own pass over globals.in where
+ * only the handlers bound to that code take up a byte. The offset of a handler
+ * in this layout becomes its id, which keeps the handlers of each code in a
+ * contiguous id range (in globals.in order) starting at the offset of the slot.
+ */
+#define _C_(code, prio, policy, type)
+#define _H_(id, handler, code, disable) u8 id[(code) == _SLOT_];
+typedef struct {
+#define _SLOT_ 0
+	struct {
+#include "globals.in"
+	} s0;
+#undef _SLOT_
+#define _SLOT_ 1
+	struct {
+#include "globals.in"
+	} s1;
+#undef _SLOT_
+#define _SLOT_ 2
+	struct {
+#include "globals.in"
+	} s2;
+#undef _SLOT_
+#define _SLOT_ 3
+	struct {
+#include "globals.in"
+	} s3;
+#undef _SLOT_
+#define _SLOT_ 4
+	struct {
+#include "globals.in"
+	} s4;
+#undef _SLOT_
+#define _SLOT_ 5
+	struct {
+#include "globals.in"
+	} s5;
+#undef _SLOT_
+#define _SLOT_ 6
+	struct {
+#include "globals.in"
+	} s6;
+#undef _SLOT_
+#define _SLOT_ 7
+	struct {
+#include "globals.in"
+	} s7;
+#undef _SLOT_
+} _handler_layout_t;
+#undef _C_
+#undef _H_
+
+// offset of (member m in) the slot of an event code
+#define _slot(code, m) ( \
+	(code) == 0 ? offsetof(_handler_layout_t, s0 m) : \
+	(code) == 1 ? offsetof(_handler_layout_t, s1 m) : \
+	(code) == 2 ? offsetof(_handler_layout_t, s2 m) : \
+	(code) == 3 ? offsetof(_handler_layout_t, s3 m) : \
+	(code) == 4 ? offsetof(_handler_layout_t, s4 m) : \
+	(code) == 5 ? offsetof(_handler_layout_t, s5 m) : \
+	(code) == 6 ? offsetof(_handler_layout_t, s6 m) : \
+	(code) == 7 ? offsetof(_handler_layout_t, s7 m) : \
+	sizeof(_handler_layout_t))
+
+// event handler ids (grouped by event code)
 typedef enum {
-#define _C_(code)
-#define _H_(id, handler, code, disable) id,
+#define _C_(code, prio, policy, type)
+#define _H_(id, handler, code, disable) id = _slot(code, .id),
 #include "globals.in"
 #undef _C_
 #undef _H_
+	_N_HANDLERS = sizeof(_handler_layout_t) // number of handlers
 } _handler_id_t;
 
-// macro trickery to allow dispatch() to have
-// the argument parameter as optional (NULL)
-#define __dispatch(code, arg) ({ \
-	event_t __event = {(_event_code_t)code, (arg)}; \
-	event_dispatch(&g_event_loop, &__event, 0); })
+// event payload types (_event_arg_<code>_t)
+#define _C_(code, prio, policy, type) typedef type _event_arg_##code##_t;
+#define _H_(id, handler, code, disable)
+#include "globals.in"
+#undef _C_
+#undef _H_
+
+// all event payloads (has to fit in event_t)
+typedef union {
+#define _C_(code, prio, policy, type) type code;
+#define _H_(id, handler, code, disable)
+#include "globals.in"
+#undef _C_
+#undef _H_
+} _event_arg_t;
+
+// macro trickery to allow dispatch() to have the payload parameter as
+// optional (zeroed), it's converted to the payload type of the code and
+// copied into the event buffer (code has to be a literal event code)
+#define __dispatch(c, a) ({ \
+	_event_arg_##c##_t __arg = a; \
+	event_dispatch(&g_event_loop, (_event_code_t)c, &__arg, 0); })
 #define __dispatch_expand(a, b) __dispatch(a, b)
 #define __dispatch_arg(a, b, ...) b
 #define dispatch(code, ...) \
-	__dispatch_expand(code, __dispatch_arg(,##__VA_ARGS__, NULL))
+	__dispatch_expand(code, __dispatch_arg(,##__VA_ARGS__, {}))
 
 // wrappers for other event.c functions that apply
 // to the global event loop structure
@@ -51,6 +151,26 @@ typedef enum {
 	event_set_code(&g_event_loop, (_event_code_t)code, (disable))
 #define ev_run() \
 	event_run(&g_event_loop)
+#define defer(func, arg) \
+	event_defer(&g_event_loop, (func), (arg))
+#define ev_over() \
+	event_over(&g_event_loop)
+#define ev_idle() \
+	event_idle(&g_event_loop, HOOKS)
+#define ev_pending() \
+	event_pending(&g_event_loop)
+#define ev_room(code) \
+	event_room(&g_event_loop, (_event_code_t)code)
+
+#ifdef EVENT_PROFILE
+// handler profiles (indexed by id)
+extern event_prof_t g_event_prof[_N_HANDLERS];
+#endif
+
+#ifdef EVENT_TRACE
+// flight recorder (kept over resets)
+extern event_recorder_t g_event_trace;
+#endif
 
 // I fully aknowledge that no having parentheses in the macro
 // arguments above is dangerous but it can't be avoided here.
@@ -1,10 +1,11 @@
 #include "globals.h"
 #include "util/init.h"
-#include "util/sleep.h"
 #include "common/defs.h"
 #include "common/timer.h"
+#include "common/power.h"
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 
 /* base initialization, modules should use INIT() without
  * parameters for their initialization to execute after this
@@ -42,7 +43,9 @@ INIT(1)
 	PRR = _BV(PRTWI) | _BV(PRTIM2) | _BV(PRSPI) | _BV(PRADC);
 #endif
 
-	/* setup sleep (idle mode --> USART wakeup) */
+	/* setup sleep (idle mode --> USART wakeup), common/power.c picks
+	 * the mode before each sleep from the wake sources modules hold
+	 */
 	SMCR = 0; // sleep mode --> idle
 
 	/* initialize IO ports into pullup mode (least power loss on unused pins) */
@@ -68,10 +71,12 @@ main:
 	/* main() runs the global event loop and puts the CPU into sleep
 	 * if no events are coming in (ie. only possible event sources are
 	 * interrupt handlers), thus this loop will run at least at the
-	 * configured global tick timer interrupt frequency.
+	 * configured global tick timer interrupt frequency (or only at the
+	 * software timer deadlines with TIMER_TICKLESS). Idle hooks run
+	 * when no events are left and keep it awake while they have work.
 	 */
-	if (unlikely(ev_run() < 1))
-	    	sleep(); // sleep until interrupt
+	if (unlikely(ev_run() < 1) && !ev_idle())
+		power_sleep(); // sleep until interrupt
 	goto main;
 	unreachable;
 }
@@ -7,6 +7,7 @@
 #define _used       __attribute__((used))
 #define naked       __attribute__((naked))
 #define packed      __attribute__((packed))
+#define noinit      __attribute__((section(".noinit")))
 #define may_alias   __attribute__((__may_alias__))
 #define fallthrough __attribute__((fallthrough))
 #define unreachable __builtin_unreachable()
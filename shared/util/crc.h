@@ -0,0 +1,22 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include "util/type.h"
+#include "util/memory.h"
+
+/* CRC-16/CCITT-FALSE (polynomial 0x1021, MSB first, no final XOR), a table
+ * lookup per byte. Appending the CRC to the data (high byte first) makes
+ * the CRC of the whole thing 0.
+ */
+#define CRC16_INIT 0xFFFF
+
+extern const u16 crc16_table[256] PROGMEM;
+
+// add byte to CRC (for ISRs, no call)
+#define crc16_step(crc, byte) \
+	((u16)((crc) << 8) ^ rom(crc16_table[(u8)((crc) >> 8) ^ (byte)], word))
+
+// add data to CRC
+u16 crc16(u16 crc, const void *data, u8 size);
+
+#endif // !CRC_H
@@ -1,26 +1,55 @@
 #include "util/event.h"
 #include "util/memory.h"
 #include "util/interrupt.h"
+#include "common/timer.h"
+
+#include <string.h>
+
+// bits within a byte of the disable mask (no barrel shifter)
+static const u8 bits[8] PROGMEM = {
+	_BV(0), _BV(1), _BV(2), _BV(3), _BV(4), _BV(5), _BV(6), _BV(7)
+};
+
+// oldest buffered event of code (ring_count(buf) if none, interrupts
+// disabled)
+static u8 event_find(ring_t *buf, u8 code)
+{
+	event_t *ev;
+	u8 i;
+
+	for (i = 0; (ev = ring_get_as(event_t, buf, i)) != NULL; i++)
+		if (ev->code == code)
+			break;
+
+	return i;
+}
+
+// update whether an event code has enabled handlers (interrupts disabled)
+static void event_live(event_loop_t *loop, u8 code, event_mask_t mask)
+{
+	u8 bit = rom(bits[code], byte);
+
+	if ((loop->disable & mask) == mask)
+		loop->live &= ~bit;
+	else
+		loop->live |= bit;
+}
 
 // disable event handler (by id)
 void event_set_id(event_loop_t *loop, u8 id, u8 disable)
 {
-	u8 n;
+	u8 *byte = (u8 *)&loop->disable + (id >> 3); // little endian
+	u8 bit = rom(bits[id & 7], byte);
+	u8 code = rom(loop->handlers[id].code, byte);
+	event_mask_t mask = rom(loop->info[code].mask, dword);
 
 	save_int();
 
-	// number of handlers
-	n = loop->n_handlers;
-	for (u8 i = 0; i < n; i++)
-	{
-		event_handler_t *h = &loop->handlers[i];
-
-		// assume duplicate id's don't exist (they shouldn't)
-		if (unlikely(rom(h->rom->id, word) == id)) {
-			h->disable = disable;
-			break;
-		}
-	}
+	if (disable)
+		*byte |= bit;
+	else
+		*byte &= ~bit;
+	event_live(loop, code, mask);
 
 	rest_int();
 }
@@ -28,74 +57,339 @@ void event_set_id(event_loop_t *loop, u8 id, u8 disable)
 // disable event handlers (by event code)
 void event_set_code(event_loop_t *loop, u8 code, u8 disable)
 {
-	u8 n;
+	event_mask_t mask = rom(loop->info[code].mask, dword);
 
 	save_int();
 
-	// number of handlers
-	n = loop->n_handlers;
-	for (u8 i = 0; i < n; i++)
-	{
-		event_handler_t *h = &loop->handlers[i];
+	if (disable)
+		loop->disable |= mask;
+	else
+		loop->disable &= ~mask;
+	event_live(loop, code, mask);
+
+	rest_int();
+}
+
+#ifdef EVENT_TRACE
+// add flight recorder entry
+void event_trace(event_loop_t *loop, u8 code, u8 id, u8 depth)
+{
+	event_recorder_t *rec = loop->trace;
+	event_trace_t *e;
 
-		// event code match
-		if (unlikely(rom(h->rom->code, word) == code))
-			h->disable = disable;
+	// several producers (ISRs and the main loop)
+	save_int();
+
+	if (likely(!rec->pause)) {
+		e = &rec->log[rec->head++ & ((1 << EVENT_TRACE_BITS) - 1)];
+		e->code  = code;
+		e->id    = id;
+		e->time  = timer_now();
+		e->depth = depth;
 	}
 
 	rest_int();
 }
+#else
+#define event_trace(loop, code, id, depth) ((void) 0)
+#endif
+
+// pop highest priority event (returns EVENT_PRIORITIES if none)
+static u8 event_pop(event_loop_t *loop, event_t *ev)
+{
+	u8 q;
+
+	// producers in ISRs may drop or replace buffered events
+	save_int();
+
+	for (q = 0; q < EVENT_PRIORITIES; q++)
+		if (ring_pop_as(event_t, loop->buffer[q], ev) != NULL)
+			break;
+
+	rest_int();
+
+	return q;
+}
+
+// run deferred calls (returns how many ran)
+static u8 event_drain(event_loop_t *loop)
+{
+	event_defer_t call;
+	u8 p = 0;
+
+	// producers are serialized by event_defer(), so the
+	// main loop can consume without masking interrupts
+	while (ring_pop_as(event_defer_t, loop->defer, &call) != NULL) {
+		call.func(call.arg);
+		p++;
+	}
+
+	return p;
+}
+
+// put event back behind the ones buffered meanwhile (nonzero if full)
+static u8 event_requeue(event_loop_t *loop, u8 q, event_t *ev)
+{
+	ring_t *buf = loop->buffer[q];
+	u8 r;
+
+#ifdef EVENT_STATS
+	ev->time = timer_now();
+#endif
+
+	// producers in ISRs
+	save_int();
+	r = ring_put_as(event_t, buf, ev) == NULL;
+	rest_int();
+
+	if (!r)
+		event_trace(loop, ev->code, TRACE_DISPATCH, ring_count(buf));
+
+	return r;
+}
+
+// is the running handler over budget
+u8 event_over(event_loop_t *loop)
+{
+	return (u16)(timer_now() - loop->start) >= loop->limit;
+}
+
+// call handler (bit of its id in mask), timed against the budget
+static u8 event_call(event_loop_t *loop, u8 i, u8 code, ptr arg,
+	event_mask_t mask)
+{
+	loop->start = timer_now();
+	u8 r = rom(loop->handlers[i].func, ptr)(i, code, arg);
+	u16 t = timer_now() - loop->start;
+
+	// went over budget
+	if (t > loop->limit)
+		loop->overrun |= mask;
+
+#ifdef EVENT_PROFILE
+	// account call to handler
+	event_prof_t *prof = &loop->prof[i];
+	prof->count++;
+	prof->total += t;
+	if (t > prof->max)
+		prof->max = t;
+#endif
+
+	return r;
+}
 
 // run an event loop (handle buffered events)
 u8 event_run(event_loop_t *loop)
 {
 	event_t ev;
 	u8 p = 0;
+	u8 q;
 
-	save_int();
+	// budget in timer counts (prescaler may have changed)
+	loop->limit = loop->budget >> timer_shift();
 
-	// loop through event buffer
-	while (ring_pop(loop->buffer, &ev) != NULL)
+	while (1)
 	{
-		// call event handlers
-		for (u8 i = 0; i < loop->n_handlers; i++)
-		{
-			event_handler_t *h = &loop->handlers[i];
+		// bottom halves of ISRs go ahead of every event
+		p += event_drain(loop);
 
-			// event handler is disabled
-			if (h->disable)
-				continue;
+		// loop through event buffers (higher priorities first)
+		if ((q = event_pop(loop, &ev)) >= EVENT_PRIORITIES)
+			break;
 
-			// call event handler if event code matches
-			if (unlikely(
-				rom(h->rom->code, word) == ev.code
-			)) {
-				sei(); // enable interrupts
+#ifdef EVENT_STATS
+		// worst-case time spent in buffer
+		u16 d = timer_now() - ev.time;
+		if (d > loop->delay[q])
+			loop->delay[q] = d;
+#endif
+		// handlers bound to the event code (id range)
+		const _event_info_t *info = &loop->info[ev.code];
+		event_mask_t mask = rom(info->mask, dword);
 
-				// run with interrupts enabled
-				u8 r = rom(h->rom->func, ptr)(
-					rom(h->rom->id, word),
-					ev.code, ev.arg);
+		// all of them disabled (or none bound)
+		if ((loop->disable & mask) == mask)
+			goto next;
 
-				cli(); // disable interrupts
+		// call event handlers
+		u8 n = rom(info[1].first, byte);
+		mask &= -mask; // bit of first handler
+		for (u8 i = rom(info->first, byte); i < n; i++, mask <<= 1)
+		{
+			// event handler is disabled (or ran before a re-queue)
+			if ((loop->disable & mask) || i + 1 < ev.from)
+				continue;
 
-				// prevent other handlers from being run
-				if (r)
-					break;
+			// events left behind this one
+			event_trace(loop, ev.code, i, ring_count(loop->buffer[q]));
+again:
+			// run with interrupts enabled
+			u8 r = event_call(loop, i, ev.code, ev.arg, mask);
+
+			// work left, continue after the events buffered meanwhile
+			// (or right away if there's no room to put it back)
+			if (r == EVENT_AGAIN) {
+				ev.from = i + 1;
+				if (event_requeue(loop, q, &ev))
+					goto again;
+				break;
 			}
-		}
 
+			// prevent other handlers from being run
+			if (r)
+				break;
+		}
+next:
 		p++; // increment no. of handled events
 	}
 
-	rest_int();
+	return p;
+}
+
+// events or deferred calls buffered (interrupts disabled)
+u8 event_pending(event_loop_t *loop)
+{
+	for (u8 q = 0; q < EVENT_PRIORITIES; q++)
+		if (ring_count(loop->buffer[q]))
+			return 1;
+
+	return ring_count(loop->defer) != 0;
+}
+
+// an event of code would be buffered (interrupts disabled)
+u8 event_room(event_loop_t *loop, u8 code)
+{
+	const _event_info_t *info = &loop->info[code];
+	ring_t *buf = loop->buffer[rom(info->prio, byte)];
+
+	// room is made (REPLACE may have a pending one, but needn't)
+	if (rom(info->policy, byte) == DROP_OLD &&
+	    event_find(buf, code) < ring_count(buf))
+		return 1;
+
+	return ring_count(buf) <= buf->mask;
+}
+
+// run a step of each idle hook (enabled handlers of code)
+u8 event_idle(event_loop_t *loop, u8 code)
+{
+	const _event_info_t *info = &loop->info[code];
+	u8 p = 0;
+
+	// all of them disabled
+	if (!(loop->live & rom(bits[code], byte)))
+		return 0;
+
+	// no tracing, hooks run on every pass of an idle loop
+	event_mask_t mask = rom(info->mask, dword);
+	u8 n = rom(info[1].first, byte);
+	mask &= -mask; // bit of first hook
+	for (u8 i = rom(info->first, byte); i < n; i++, mask <<= 1)
+	{
+		if (loop->disable & mask)
+			continue;
+
+		// count hooks with work left
+		if (event_call(loop, i, code, NULL, mask) == EVENT_AGAIN)
+			p++;
+	}
 
 	return p;
 }
 
-// dispatch event to an event loop
-u8 event_dispatch(event_loop_t *loop, const event_t *event, u8 flags)
+// defer call to an event loop
+u8 event_defer(event_loop_t *loop, void (*func)(u8), u8 arg)
 {
-	// add event to buffer (may be discarded)
-	return ring_put(loop->buffer, (ptr)event, flags) == NULL;
+	event_defer_t call = {func, arg};
+	u8 r;
+
+	// several producers (ISRs and the main loop)
+	save_int();
+	r = ring_put_as(event_defer_t, loop->defer, &call) == NULL;
+	rest_int();
+
+	return r;
+}
+
+// dispatch event to an event loop (payload is copied, may be in ROM)
+u8 event_dispatch(event_loop_t *loop, u8 code, const void *arg, u8 flags)
+{
+	const _event_info_t *info = &loop->info[code];
+	u8 prio = rom(info->prio, byte);
+	u8 size = rom(info->size, byte);
+	ring_t *buf = loop->buffer[prio];
+	event_t *ev;
+
+	// nobody would handle it, don't buffer it (not a drop)
+	if (!(loop->live & rom(bits[code], byte)))
+		return EVENT_DISCARDED;
+
+	// several producers (ISRs and the main loop)
+	save_int();
+
+	switch (rom(info->policy, byte)) {
+	// overwrite pending event of same code (keeps its place), one that
+	// was put back with work left is appended to instead
+	case REPLACE:
+		for (u8 i = 0; (ev = ring_get_as(event_t, buf, i)) != NULL; i++) {
+			if (ev->code == code && ev->from == 0) {
+				event_trace(loop, code, TRACE_DISPATCH, ring_count(buf));
+				goto copy;
+			}
+		}
+		break;
+
+	// make room by dropping oldest of the same code (others sharing
+	// the buffer keep theirs, the new one is dropped if there is none)
+	case DROP_OLD:
+		if (ring_count(buf) > buf->mask) {
+			u8 i = event_find(buf, code);
+			if (i >= ring_count(buf))
+				break;
+
+			// events in front of it move back a slot
+			for (; i > 0; i--)
+				memcpy(ring_get_as(event_t, buf, i),
+					ring_get_as(event_t, buf, i - 1), sizeof(event_t));
+			(void) ring_pop_as(event_t, buf, NULL);
+
+			event_trace(loop, code, TRACE_DROP, ring_count(buf));
+			if (likely(loop->drops[prio] < (u8)~0))
+				loop->drops[prio]++;
+		}
+		break;
+	}
+
+	// next free slot in buffer of its priority
+	ev = ring_reserve_as(event_t, buf);
+
+	// dropped (DROP_NEW)
+	if (ev == NULL) {
+		if (likely(loop->drops[prio] < (u8)~0))
+			loop->drops[prio]++;
+		event_trace(loop, code, TRACE_DROP, ring_count(buf));
+		goto end;
+	}
+
+	ev->code = code;
+	ev->from = 0; // all handlers
+#ifdef EVENT_STATS
+	ev->time = timer_now();
+#endif
+	ring_commit(buf);
+
+	// high-water mark
+	if (ring_count(buf) > loop->peak[prio])
+		loop->peak[prio] = ring_count(buf);
+	event_trace(loop, code, TRACE_DISPATCH, ring_count(buf));
+copy:
+	// payload by value (masked, so the slot can be published first)
+	if (flags & ROMDATA)
+		memcpy_P(ev->arg, arg, size);
+	else
+		memcpy(ev->arg, arg, size);
+end:
+	rest_int();
+
+	return ev == NULL ? EVENT_DROPPED : EVENT_BUFFERED;
 }
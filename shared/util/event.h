@@ -6,34 +6,135 @@
 #include "util/ring.h"
 #include "util/memory.h"
 
-// passed to dispatch() from stack
+// event priorities (each has a ring, drained highest first)
+#define EVENT_PRIORITIES 3
+#define PRIO_HIGH   0
+#define PRIO_NORMAL 1
+#define PRIO_LOW    2
+
+// event buffer overflow policies (per event code)
+#define DROP_NEW 0 // drop event being dispatched
+#define DROP_OLD 1 // drop oldest event of same code in buffer
+#define REPLACE  2 // overwrite pending event of same code (even if not full)
+
+// handler return values
+#define EVENT_NEXT  0 // run the next handler of the event
+#define EVENT_STOP  1 // don't run the remaining handlers
+#define EVENT_AGAIN 2 // work left, call this handler again (re-queued)
+
+// event_dispatch() results
+#define EVENT_BUFFERED  0 // buffered (or merged into a pending one)
+#define EVENT_DROPPED   1 // buffer full
+#define EVENT_DISCARDED 2 // no enabled handlers (not a drop)
+
+// largest event payload (checked against globals.in in globals.c)
+#define EVENT_ARGSIZE 4
+
+// payload type of events without data
+typedef struct {} packed event_none_t;
+
+// handler enable state is a bitmask (bit = handler id)
+typedef u32 event_mask_t;
+#define EVENT_MAXHANDLERS (8*sizeof(event_mask_t))
+
+// buffered event (payload is stored by value, handlers get a pointer
+// to a copy that is valid until they return)
 typedef struct {
 	u8 code;
-	ptr arg;
+	u8 from; // handler that re-queued it + 1 (0 if none ran yet)
+#ifdef EVENT_STATS
+	u16 time; // dispatch timestamp (set by event_dispatch())
+#endif
+	u8 arg[EVENT_ARGSIZE]; // payload (type declared per code)
 } packed event_t;
 
-// stored in ROM (saves 4 bytes of RAM per handler)
+// deferred call (bottom half of an ISR)
 typedef struct {
-	u8 (*func)(u8, u8, ptr);
-	u8 code;
-	u8 id;
-} packed _event_handler_t;
+	void (*func)(u8);
+	u8 arg;
+} packed event_defer_t;
 
-// stored in RAM
+#ifdef EVENT_PROFILE
+// handler profile in TIMER1 counts (interrupts during the call are included)
+typedef struct {
+	u16 count; // calls
+	u32 total; // time spent in all calls
+	u16 max;   // longest call
+} packed event_prof_t;
+#endif
+
+#ifdef EVENT_TRACE
+// flight recorder size
+#define EVENT_TRACE_BITS 5 // (1 << 5) = 32 entries
+
+// valid recorder (RAM isn't cleared on reset)
+#define EVENT_TRACE_MAGIC 0xE7AC
+
+#define TRACE_DISPATCH 0xFF // id of a buffered event
+#define TRACE_DROP     0xFE // id of a dropped event
+#define TRACE_RESET    0xFF // code of a reset (id is MCUSR)
+#define TRACE_EMPTY    0xFF // code and id of an unused entry
+
+// flight recorder entry
+typedef struct {
+	u8 code;  // event code
+	u8 id;    // handler id (called) or TRACE_* (dispatched)
+	u16 time; // timer_now() (wraps, entries are in order)
+	u8 depth; // events in the buffer of the code's priority
+} packed event_trace_t;
+
+// flight recorder (circular, kept over resets in .noinit)
+typedef struct {
+	u16 magic; // EVENT_TRACE_MAGIC if valid
+	u8 head;   // next entry (counts up)
+	u8 pause;  // recording paused (eg. while dumping)
+	event_trace_t log[1 << EVENT_TRACE_BITS];
+} packed event_recorder_t;
+#endif
+
+// stored in ROM (one per event code)
 typedef struct {
-	_event_handler_t *rom; // ROM data
-	u8 disable;
-} packed event_handler_t;
+	u8 first; // first handler id (handlers of code are [first, next first))
+	u8 prio;  // priority
+	u8 policy; // overflow policy
+	u8 size;  // payload size
+	event_mask_t mask; // handler id range as a mask
+} packed _event_info_t;
+
+// stored in ROM (indexed by id)
+typedef struct {
+	u8 (*func)(u8, u8, ptr);
+	u8 code; // event code bound to
+} packed _event_handler_t;
 
 // stored in RAM
 // manually initialized (no sensible way of writing a generic initializer)
 typedef struct event_loop {
-	ring_t *buffer; // event buffer
-	u8 n_handlers; // number of handlers
-	event_handler_t handlers[]; // handlers (compile time constant)
+	ring_t *buffer[EVENT_PRIORITIES]; // event buffers (by priority)
+	ring_t *defer; // deferred calls (run ahead of all events)
+	const _event_info_t *info; // event code info (ROM)
+	const _event_handler_t *handlers; // event handlers (ROM)
+#ifdef EVENT_STATS
+	u16 delay[EVENT_PRIORITIES]; // worst-case queueing delay (timer counts)
+#endif
+	u8 drops[EVENT_PRIORITIES]; // dropped events (saturates)
+	u8 peak[EVENT_PRIORITIES];  // buffer high-water mark
+#ifdef EVENT_PROFILE
+	event_prof_t *prof; // handler profiles (indexed by id)
+#endif
+#ifdef EVENT_TRACE
+	event_recorder_t *trace; // flight recorder
+#endif
+	u32 budget; // handler budget (cycles, interrupts during a call count)
+	u16 limit;  // handler budget (timer counts, set by event_run())
+	u16 start;  // timer_now() when the running handler was called
+	event_mask_t overrun; // handlers that went over budget (bit = id)
+	event_mask_t disable; // disabled handlers (bit = id)
+	u8 live; // event codes with enabled handlers (bit = code)
 } packed event_loop_t;
 
-// disable event handler (by id)
+// disable event handler (by id), this and event_set_code() are the only
+// ways of changing loop->disable (they keep loop->live up to date)
 void event_set_id(event_loop_t *loop, u8 id, u8 disable);
 
 // disable event handlers (by event code)
@@ -42,7 +143,43 @@ void event_set_code(event_loop_t *loop, u8 code, u8 disable);
 // run an even loop (handle buffered events)
 u8 event_run(event_loop_t *loop);
 
-// dispatch event to an event loop
-u8 event_dispatch(event_loop_t *loop, const event_t *event, u8 flags);
+/* Handlers are expected to return within the budget of the loop, longer work
+ * is split into steps, where a step checks event_over() and returns
+ * EVENT_AGAIN when it's out of time. The event is then put back behind the
+ * events of its priority that were buffered meanwhile and the handler is
+ * called again with the same payload (handlers before it aren't). Calls
+ * that still go over budget are recorded in the overrun mask of the loop.
+ */
+u8 event_over(event_loop_t *loop);
+
+// events or deferred calls buffered (call with interrupts disabled
+// to decide whether the CPU may sleep)
+u8 event_pending(event_loop_t *loop);
+
+// an event of code would be buffered now (call with interrupts disabled
+// to dispatch it later, eg. after committing to its side effects)
+u8 event_room(event_loop_t *loop, u8 code);
+
+/* Idle hooks are the handlers of an event code that is never dispatched,
+ * the main loop calls them when it has no events left. A hook does a step
+ * of its background work (within the budget) and returns EVENT_AGAIN while
+ * it has some left or EVENT_NEXT if it has nothing to do, the main loop only
+ * sleeps after every hook returned EVENT_NEXT. Returns hooks with work left.
+ */
+u8 event_idle(event_loop_t *loop, u8 code);
+
+#ifdef EVENT_TRACE
+// add flight recorder entry (safe to call from interrupts)
+void event_trace(event_loop_t *loop, u8 code, u8 id, u8 depth);
+#endif
+
+// defer call to an event loop (ISRs only capture hardware state
+// and leave the rest to the main loop), nonzero if the buffer is full
+u8 event_defer(event_loop_t *loop, void (*func)(u8), u8 arg);
+
+// dispatch event to an event loop (payload is copied, may be in ROM),
+// events of codes without enabled handlers are discarded right away,
+// nonzero if not buffered (EVENT_DROPPED or EVENT_DISCARDED)
+u8 event_dispatch(event_loop_t *loop, u8 code, const void *arg, u8 flags);
 
 #endif // !EVENT_H
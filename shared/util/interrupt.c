@@ -0,0 +1,6 @@
+#include "util/interrupt.h"
+
+#ifdef INT_STATS
+u16 g_int_off;  // longest section with interrupts disabled
+u16 _int_mark;  // start of current section
+#endif
@@ -1,13 +1,45 @@
 #ifndef INTERRUPT_H
 #define INTERRUPT_H
 
+#include "util/type.h"
+
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
+#ifdef INT_STATS
+// longest section with interrupts disabled (TIMER1 counts), only sections
+// entered with interrupts enabled are timed (not ISRs)
+extern u16 g_int_off;
+extern u16 _int_mark;
+
+#define _int_begin() (_int_mark = TCNT1)
+#define _int_end() ({ \
+	u16 __d = TCNT1 - _int_mark; \
+	if (__d > g_int_off) \
+		g_int_off = __d; })
+
+// save interrupt mask and disable interrupts
+#define save_int() u8 __SREG = SREG; cli(); \
+	if (__SREG & _BV(SREG_I)) _int_begin()
+
+// restore interrupt mask (must be paired with save_int())
+#define rest_int() do { \
+	if (__SREG & _BV(SREG_I)) _int_end(); \
+	SREG = __SREG; } while (0)
+#else
+#define _int_begin()
+#define _int_end()
+
 // save interrupt mask and disable interrupts
 #define save_int() u8 __SREG = SREG; cli()
 
 // restore interrupt mask (must be paired with no_int())
 #define rest_int() SREG = __SREG
+#endif
+
+// enable interrupts for a while inside save_int()/rest_int()
+// (only if interrupts were enabled by save_int())
+#define ena_int() do { _int_end(); sei(); } while (0)
+#define dis_int() do { cli(); _int_begin(); } while (0)
 
 #endif
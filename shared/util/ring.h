@@ -3,34 +3,145 @@
 
 #include "util/type.h"
 
+/* Ring buffers are single-producer/single-consumer, the producer only writes
+ * head and the consumer only writes tail (both single bytes), so neither side
+ * masks interrupts. If an ISR and the main loop can both put (or both pop),
+ * the main loop side has to disable interrupts around its call.
+ */
+
 // ring buffer (FIFO)
 // (ROM wouldn't save a single byte, 2 const u8, pointer is u16)
 typedef struct {
-	u8 pos;    // position in buffer
+	u8 head;   // next item to write (free running, producer)
+	u8 tail;   // next item to read (free running, consumer)
 	u8 unit;   // size of single item
-	u8 count;  // number of items
-	u8 mask;   // mask for ring
+	u8 mask;   // mask for ring (at most 128 items)
 	u8 data[]; // actual buffer
 } ring_t;
 
 // initializer literal generator
 #define ring_init(t, s) \
-	{	.pos   = 0, \
+	{	.head  = 0, \
+		.tail  = 0, \
 		.unit  = sizeof(t), \
-		.count = 0, \
 		.mask  = (1 << (s)) - 1, \
 		.data  = { [0 ... sizeof(t)*(1 << (s)) - 1] = 0 } }
 
-#define ROMPTR (1 << 0)
-#define NILPTR (1 << 1)
+// number of buffered items
+#define ring_count(buf) ((u8)((buf)->head - (buf)->tail))
+
+/* Access is by item type, inlined with the item size as a compile time
+ * constant, so indexing is shifts and adds and items are moved with
+ * fixed-size copies. The capacity is still read from the ring (one AND) so
+ * rings of different sizes share the same code.
+ */
+
+// put item into buffer, NULL if full (producer)
+#define ring_put_as(t, buf, src)   ((t *)_ring_put((buf), (src), sizeof(t)))
+
+// pop item from buffer (discarded if dst is NULL), NULL if empty (consumer)
+#define ring_pop_as(t, buf, dst)   ((t *)_ring_pop((buf), (dst), sizeof(t)))
+
+// nth item, NULL if there are fewer (consumer)
+#define ring_get_as(t, buf, n)     ((t *)_ring_get((buf), (n), sizeof(t)))
+
+/* Zero-copy access, the producer writes the next item in place and publishes
+ * it with ring_commit() (reserving again before that gives the same slot),
+ * the consumer reads the oldest item in place and frees it with
+ * ring_release(). The producer can also fill in items further ahead with
+ * ring_reserve_nth_as(), they are published in order by one commit each.
+ */
+
+// slot for next item, NULL if full (producer)
+#define ring_reserve_as(t, buf)    ((t *)_ring_next((buf), sizeof(t)))
+#define ring_reserve_nth_as(t, buf, n) \
+	((t *)_ring_next_nth((buf), (n), sizeof(t)))
+
+// oldest item, NULL if empty (consumer)
+#define ring_peek_as(t, buf)       ((t *)_ring_get((buf), 0, sizeof(t)))
+
+// publish reserved item (producer)
+#define ring_commit(buf) _ring_push(buf)
+
+// free peeked item (consumer)
+#define ring_release(buf) _ring_pull(buf)
+
+#define _ring_inline static inline __attribute__((always_inline))
+#define _ring_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+// nth item after tail (no checks)
+_ring_inline u8 *_ring_slot(ring_t *buf, u8 i, u8 unit)
+{
+	return &buf->data[(i & buf->mask)*unit];
+}
+
+// slot for nth item after the next one (NULL if full)
+_ring_inline u8 *_ring_next_nth(ring_t *buf, u8 n, u8 unit)
+{
+	u8 head = buf->head + n;
+
+	if ((u8)(head - *(volatile u8 *)&buf->tail) > buf->mask)
+		return NULL;
+
+	return _ring_slot(buf, head, unit);
+}
+
+// slot for next item (NULL if full)
+_ring_inline u8 *_ring_next(ring_t *buf, u8 unit)
+{
+	return _ring_next_nth(buf, 0, unit);
+}
+
+// publish next item to consumer
+_ring_inline void _ring_push(ring_t *buf)
+{
+	_ring_barrier();
+	*(volatile u8 *)&buf->head = buf->head + 1;
+}
+
+// give oldest slot back to producer
+_ring_inline void _ring_pull(ring_t *buf)
+{
+	_ring_barrier();
+	*(volatile u8 *)&buf->tail = buf->tail + 1;
+}
+
+_ring_inline ptr _ring_put(ring_t *buf, const void *src, u8 unit)
+{
+	u8 *dst = _ring_next(buf, unit);
+
+	if (dst != NULL) {
+		__builtin_memcpy(dst, src, unit);
+		_ring_push(buf);
+	}
+
+	return dst;
+}
+
+_ring_inline ptr _ring_get(ring_t *buf, u8 n, u8 unit)
+{
+	u8 tail = buf->tail;
+
+	if ((u8)(*(volatile u8 *)&buf->head - tail) <= n)
+		return NULL;
+
+	return _ring_slot(buf, tail + n, unit);
+}
+
+_ring_inline ptr _ring_pop(ring_t *buf, void *dst, u8 unit)
+{
+	u8 *src = _ring_get(buf, 0, unit);
+
+	if (src == NULL)
+		return NULL;
 
-// put item into buffer
-ptr ring_put(ring_t *buf, ptr src, u8 flags);
+	// copy to dst (discarded if NULL)
+	if (dst != NULL)
+		__builtin_memcpy(dst, src, unit);
 
-// pop item from buffer 
-ptr ring_pop(ring_t *buf, ptr dst);
+	_ring_pull(buf);
 
-// get pointer to nth item
-ptr ring_get(ring_t *buf, u8 n);
+	return dst != NULL ? dst : src;
+}
 
 #endif // !RING_H
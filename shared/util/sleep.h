@@ -5,18 +5,7 @@
 #include <avr/interrupt.h>
 
 #ifndef sleep_bod_disable
-#define sleep_bod_disable()
+#define sleep_bod_disable() do {} while (0)
 #endif
 
-/* put the CPU into sleep mode */
-#define sleep() \
-	do { \
-		cli(); \
-		sleep_enable(); \
-		sleep_bod_disable(); \
-		sei(); \
-		sleep_cpu(); \
-		sleep_disable(); \
-	} while (0)
-
 #endif
@@ -0,0 +1,30 @@
+#include "util/task.h"
+
+// (re)start task from the beginning
+void task_start(task_t *t)
+{
+	stimer_cancel(&t->timer);
+
+	t->line = 0;
+	t->arg  = NULL;
+	t->timer.func(&t->timer);
+}
+
+// stop task
+void task_stop(task_t *t)
+{
+	stimer_cancel(&t->timer);
+
+	t->line = 0;
+}
+
+// resume task waiting in task_wait()
+void task_resume(task_t *t, ptr arg)
+{
+	// not running or sleeping
+	if (!task_running(t) || stimer_armed(&t->timer))
+		return;
+
+	t->arg = arg;
+	t->timer.func(&t->timer);
+}
@@ -0,0 +1,79 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "util/type.h"
+#include "util/attr.h"
+#include "common/timer.h"
+
+/* Stackless tasks (protothreads), a task body is the expiry callback of the
+ * task's software timer and resumes where it last left off by jumping to
+ * a case label (the line it left at) of a switch around the body. Nothing
+ * is kept on the stack between steps, so locals of the body don't survive
+ * task_sleep()/task_yield()/task_wait() (use statics) and these can't be
+ * used inside a switch statement of the body.
+ * Each task costs sizeof(task_t) of RAM (8 + 2 + 2 = 12 bytes on AVR) plus
+ * the statics of its body, a step costs a timer callback.
+ */
+typedef struct {
+	stimer_t timer; // sleep timer (body is the callback)
+	u16 line;       // resume point (0 if not running)
+	ptr arg;        // payload of the event the task was resumed with
+} task_t;
+
+// initializer literal generator
+#define task_init(f) \
+	{	.timer = stimer_init(f), \
+		.line  = 0, \
+		.arg   = NULL }
+
+// is task running
+#define task_running(t) ((t)->line != 0)
+
+// task body declaration (static)
+#define TASK(name) static void name(stimer_t *__timer)
+
+// first statement of a task body (declares task)
+#define task_begin() \
+	task_t *const task = (task_t *)__timer; \
+	switch (task->line) { \
+	case 0:
+
+// give up the CPU until resumed
+#define __task_leave() do { \
+	task->line = __LINE__; \
+	return; \
+	case __LINE__: \
+	; } while (0)
+
+// resume after ticks (at least 1)
+#define task_sleep(ticks) do { \
+	stimer_arm(&task->timer, (ticks), 0); \
+	__task_leave(); } while (0)
+
+// resume on the next tick
+#define task_yield() task_sleep(1)
+
+// resume with task_resume() (event payload is in task->arg)
+#define task_wait() __task_leave()
+
+// end task before its last statement
+#define task_exit() do { \
+	task->line = 0; \
+	return; } while (0)
+
+// last statement of a task body
+#define task_end() \
+	} \
+	task->line = 0
+
+// (re)start task from the beginning (runs up to its first wait)
+void task_start(task_t *t);
+
+// stop task
+void task_stop(task_t *t);
+
+// resume task waiting in task_wait() (from an event handler, arg is valid
+// until the body waits again), ignored if the task isn't waiting
+void task_resume(task_t *t, ptr arg);
+
+#endif // !TASK_H
@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+"""Flight recorder and power counter decoder (boards built with
+FLAGS="-DEVENT_TRACE" and/or FLAGS="-DSLEEP_STATS")
+
+usage:
+ ./trace.py request [--power] > /dev/ttyUSB0  -> send TRACE (POWER) request
+ ./trace.py decode {mega|uno} < capture.bin  -> decode TRACE/POWER messages
+
+capture.bin is the raw byte stream from the TX line of the board (eg. a USB
+serial adapter at 500000 baud, 8N1).
+"""
+
+import re
+import struct
+import sys
+from pathlib import Path
+
+GLOBALS = Path(__file__).resolve().parent / "shared" / "main" / "globals.in"
+
+# frames are COBS encoded packets (header, sequence number if not a
+# message, body) and CRC-16, ended by a zero
+FRAME_DELIM = 0
+FRAME_MORE  = 0x80 # another packet follows
+
+
+def header(kind, mode, status=0):
+    return kind | (mode << 4) | (status << 6)
+
+# packet_t enumerations (common/serial.h)
+SYNC, CHANGE, CHKCODE, NEWCODE, TRACE, PROFILE, POWER = range(7)
+REQUEST, RESPONSE, MESSAGE = 0, 1, 2
+
+# body sizes by type and mode (bodies in common/serial.c)
+BODIES = {
+    SYNC:    (0, 1, 1),
+    CHANGE:  (2, 0, 2),
+    CHKCODE: (2, 0, 0),
+    NEWCODE: (4, 0, 0),
+    TRACE:   (0, 0, 7),
+    PROFILE: (0, 0, 10),
+    POWER:   (0, 0, 7),
+}
+
+# event_recorder_t constants (util/event.h)
+TRACE_DISPATCH = 0xFF
+TRACE_DROP     = 0xFE
+TRACE_RESET    = 0xFF
+TRACE_EMPTY    = 0xFF
+
+# power_stats_t counters (common/power.h), times are TIMER1 counts
+POWER_MODES = ["idle", "power-down"]
+WAKE_SOURCES = ["TIMER1", "USART RX", "USART UDRE", "PCINT2", "other"]
+COUNTERS = (["awake"]
+    + [f"asleep ({m})" for m in POWER_MODES]
+    + [f"sleeps ({m})" for m in POWER_MODES]
+    + [f"wakeups ({s})" for s in WAKE_SOURCES])
+TIMES = 1 + len(POWER_MODES)
+
+# MCUSR bits
+RESETS = ["PORF", "EXTRF", "BORF", "WDRF", "JTRF"]
+
+F_CPU = 16000000
+
+
+def names(platform):
+    """event code and handler id names of a board from globals.in"""
+    codes, handlers = [], []
+    active = True
+
+    for line in GLOBALS.read_text().splitlines():
+        line = line.split("//")[0].strip()
+        m = re.match(r"#(?:el)?if\s+PLATFORM\s*==\s*(\w+)", line)
+        if m:
+            active = m.group(1) == platform
+        elif line.startswith("#endif"):
+            active = True
+        elif not active:
+            continue
+        elif m := re.match(r"_C_\(\s*(\w+)\s*,", line):
+            codes.append(m.group(1))
+        elif m := re.match(r"_H_\(\s*(\w+)\s*,\s*\w+\s*,\s*(\w+)\s*,", line):
+            handlers.append((m.group(1), m.group(2)))
+
+    # handler ids are grouped by event code (globals.h)
+    ids = [h for c in codes for h, hc in handlers if hc == c]
+    return codes, ids
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE (util/crc.h)"""
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = (crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1
+        crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out, block = bytearray(), bytearray()
+    for b in data:
+        if b == 0:
+            out += bytes([len(block) + 1]) + block
+            block.clear()
+            continue
+        block.append(b)
+        if len(block) == 0xFE:
+            out += bytes([0xFF]) + block
+            block.clear()
+    return bytes(out + bytes([len(block) + 1]) + block)
+
+
+def cobs_decode(data):
+    out, i = bytearray(), 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def request(kind):
+    # header and sequence number, dump requests have no body (and no
+    # response, so they are never taken for a repeated request)
+    packet = bytes([header(kind, REQUEST), 0])
+    frame = packet + struct.pack(">H", crc16(packet))
+    sys.stdout.buffer.write(bytes([FRAME_DELIM]) + cobs_encode(frame)
+                            + bytes([FRAME_DELIM]))
+
+
+def packets(data):
+    """header (without FRAME_MORE) and body of the packets of the frames
+    that pass the CRC check"""
+    for chunk in data.split(bytes([FRAME_DELIM])):
+        frame = cobs_decode(chunk) if chunk else None
+        if frame is None or len(frame) < 3 or crc16(frame) != 0:
+            continue
+
+        i, more, found = 0, True, []
+        while more and i < len(frame) - 2:
+            head = frame[i]
+            kind, mode = head & 0x0F, (head >> 4) & 0x03
+            if kind not in BODIES or mode > MESSAGE:
+                break
+            start = i + 1 + (mode != MESSAGE)
+            i = start + BODIES[kind][mode]
+            more = head & FRAME_MORE
+            found.append((head & ~FRAME_MORE, frame[start:i]))
+
+        # packets have to add up to the frame
+        if not more and i == len(frame) - 2:
+            yield from found
+
+
+def power(body, counters):
+    """collect a POWER message, print the counters after the last one"""
+    index, count, shift, value = struct.unpack_from("<BBBI", body)
+    if index >= len(COUNTERS):
+        return
+    counters[index] = (value << shift) * 1000000 // F_CPU \
+        if index < TIMES else value
+    if index != count - 1:
+        return
+
+    total = sum(counters.get(i, 0) for i in range(TIMES)) or 1
+    for i, name in enumerate(COUNTERS):
+        if i not in counters:
+            continue
+        if i < TIMES:
+            share = 100 * counters[i] / total
+            print(f"    {name:<20} {counters[i]:>12} us {share:6.2f}%")
+        else:
+            print(f"    {name:<20} {counters[i]:>12}")
+    counters.clear()
+
+
+def decode(platform):
+    codes, ids = names(platform.upper())
+    elapsed = last = None
+    counters = {}
+
+    print(f"{'#':>3} {'time [us]':>12}  {'event':<8} {'handler':<16} depth")
+    for head, body in packets(sys.stdin.buffer.read()):
+        if len(body) < 7 or head & 0x3F not in (header(TRACE, MESSAGE),
+                                                header(POWER, MESSAGE)):
+            continue
+        if head & 0x0F == POWER:
+            power(body, counters)
+            continue
+
+        index, shift, code, hid, time, depth = struct.unpack_from("<BBBBHB", body)
+
+        if code == TRACE_EMPTY and hid == TRACE_EMPTY:
+            continue
+
+        if code == TRACE_RESET:
+            cause = [n for b, n in enumerate(RESETS) if hid & (1 << b)]
+            print(f"{index:>3} {'':>12}  reset ({' '.join(cause) or 'none'})")
+            elapsed = last = None
+            continue
+
+        # 16-bit timestamps wrap, entries are in order
+        if last is None:
+            elapsed, last = 0, time
+        elapsed += (time - last) & 0xFFFF
+        last = time
+        us = (elapsed << shift) * 1000000 // F_CPU
+
+        name = codes[code] if code < len(codes) else f"code {code}"
+        if hid == TRACE_DISPATCH:
+            handler = "(dispatch)"
+        elif hid == TRACE_DROP:
+            handler = "(dropped)"
+        else:
+            handler = ids[hid] if hid < len(ids) else f"id {hid}"
+
+        print(f"{index:>3} {us:>12}  {name:<8} {handler:<16} {depth}")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) >= 2 and sys.argv[1] == "request":
+        request(POWER if "--power" in sys.argv[2:] else TRACE)
+    elif len(sys.argv) == 3 and sys.argv[1] == "decode" \
+            and sys.argv[2] in ("mega", "uno"):
+        decode(sys.argv[2])
+    else:
+        sys.exit(__doc__)